@@ -4,19 +4,21 @@
 
 void debugprintf(const char* str, ...)
 {
-  static char buffer[512];
+  char buffer[512];
   va_list args;
   va_start (args, str);
   vsnprintf (buffer, 512, str, args);
+  va_end (args);
   printf("%s\n", buffer);
 }
 
 void debugnnprintf(const char* str, ...)
 {
-  static char buffer[512];
+  char buffer[512];
   va_list args;
   va_start (args, str);
   vsnprintf (buffer, 512, str, args);
+  va_end (args);
   printf("%s", buffer);
 }
 
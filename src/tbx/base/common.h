@@ -10,6 +10,7 @@
 #include "tbx/extra/fmt/printf.h"
 #include "exceptions.h"
 #include "path.h"
+#include "tracer.h"
 
 
 
@@ -59,6 +60,8 @@ extern void debugnnprintf(const char* str, ...);
 #define LOG(...) do { } while (false)
 #endif
 
+/* initial state of the runtime tracer categories, enabled ones are also echoed synchronously as before,
+   both can be changed later through tracer::enable and tracer::setEcho */
 #define TRACE_MEMORY_BUFFERS 0
 #define TRACE_PIPES 0
 #define TRACE_ARCHIVE 1
@@ -67,63 +70,23 @@ extern void debugnnprintf(const char* str, ...);
 #define TRACE_FILES 0
 #define TRACE_FILE_SYSTEM 0
 
+/* compiles every trace point out */
 #define TRACE_FORCE_DISABLE 0
 
-
 #if defined(TRACE_FORCE_DISABLE) && TRACE_FORCE_DISABLE == 1
-#define TRACEL(...) do { } while (false)
-#else
-#define TRACEL LOG
-#endif
-
-#if defined(TRACE_MEMORY_BUFFERS) && TRACE_MEMORY_BUFFERS == 1
-#define TRACE_MB TRACEL
-#else
-#define TRACE_MB(...) do { } while (false)
-#endif
-
-#if defined(TRACE_PIPES) && TRACE_PIPES == 1
-#define TRACE_P TRACEL
-#else
-#define TRACE_P(...) do { } while (false)
-#endif
-
-#if defined(TRACE_FILES) && TRACE_FILES == 1
-#define TRACE_F TRACEL
-#else
-#define TRACE_F(...) do { } while (false)
-#endif
-
-#if defined(TRACE_FILE_SYSTEM) && TRACE_FILE_SYSTEM == 1
-#define TRACE_FS TRACEL
-#else
-#define TRACE_FS(...) do { } while (false)
-#endif
-
-#if defined(TRACE_ARCHIVE) && TRACE_ARCHIVE >= 1
-#define TRACE_A TRACEL
-#if TRACE_ARCHIVE >= 2
-#define TRACE_A2 TRACEL
-#endif
-#else
-#define TRACE_A(...) do { } while (false)
-#endif
-
-#if defined(TRACE_ARCHIVE_BUILDER) && TRACE_ARCHIVE_BUILDER == 1
-#define TRACE_AB TRACEL
+#define TRACE_EVENT(c, ...) do { } while (false)
 #else
-#define TRACE_AB(...) do { } while (false)
+#define TRACE_EVENT(c, ...) do { if (tracer::enabled(c)) tracer::record(c, __VA_ARGS__); } while (false)
 #endif
 
-#if !defined(TRACE_A2)
-#define TRACE_A2(...) do { } while (false)
-#endif
-
-#if defined(TRACE_ENABLED) && TRACE_ENABLED == 1
-#define TRACE TRACEL
-#else
-#define TRACE(...) do { } while (false)
-#endif
+#define TRACE_MB(...) TRACE_EVENT(tracer::MEMORY_BUFFERS, __VA_ARGS__)
+#define TRACE_P(...) TRACE_EVENT(tracer::PIPES, __VA_ARGS__)
+#define TRACE_F(...) TRACE_EVENT(tracer::FILES, __VA_ARGS__)
+#define TRACE_FS(...) TRACE_EVENT(tracer::FILE_SYSTEM, __VA_ARGS__)
+#define TRACE_A(...) TRACE_EVENT(tracer::ARCHIVE, __VA_ARGS__)
+#define TRACE_A2(...) TRACE_EVENT(tracer::ARCHIVE_DETAIL, __VA_ARGS__)
+#define TRACE_AB(...) TRACE_EVENT(tracer::ARCHIVE_BUILDER, __VA_ARGS__)
+#define TRACE(...) TRACE_EVENT(tracer::GENERAL, __VA_ARGS__)
 
 #define TRACE_IF(c, ...) if (c) { TRACE(__VA_ARGS__); }
 
@@ -197,6 +160,32 @@ namespace hidden
   private:
     u32 data;
   };
+  
+  /* byte by byte so they work on unaligned data whatever the host order */
+  inline void writeLE32(byte* dest, u32 value)
+  {
+    for (size_t i = 0; i < 4; ++i)
+      dest[i] = (value >> (i*8)) & 0xFF;
+  }
+  
+  inline u32 readLE32(const byte* src)
+  {
+    return u32(src[0]) | (u32(src[1]) << 8) | (u32(src[2]) << 16) | (u32(src[3]) << 24);
+  }
+  
+  inline void writeLE64(byte* dest, u64 value)
+  {
+    for (size_t i = 0; i < 8; ++i)
+      dest[i] = (value >> (i*8)) & 0xFF;
+  }
+  
+  inline u64 readLE64(const byte* src)
+  {
+    u64 value = 0;
+    for (size_t i = 0; i < 8; ++i)
+      value |= u64(src[i]) << (i*8);
+    return value;
+  }
 }
 
 using u16le = std::conditional<IS_LITTLE_ENDIAN_, hidden::u16se, hidden::u16re>::type;
@@ -251,8 +240,8 @@ private:
   u64 _data;
   
 public:
-  optional<u32>() : _data(EMPTY_VALUE) { }
-  optional<u32>(u32 data) : _data(data) { }
+  optional() : _data(EMPTY_VALUE) { }
+  optional(u32 data) : _data(data) { }
   
   bool isPresent() const { return ((_data >> 32) & 0xFFFFFFFF) == 0; }
   void set(u32 data) { this->_data = data; }
@@ -357,6 +346,7 @@ private:
 ;
 
 #pragma powers of two
+constexpr size_t KB4 = 4096;
 constexpr size_t KB8 = 8192;
 constexpr size_t KB16 = 16384;
 constexpr size_t KB32 = 16384 << 1;
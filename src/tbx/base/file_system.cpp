@@ -1,4 +1,7 @@
 #include "file_system.h"
+#include "thread_pool.h"
+
+#include <atomic>
 
 const FileSystem* FileSystem::i()
 {
@@ -11,10 +14,19 @@ const FileSystem* FileSystem::i()
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
+/* glibc declares a struct file_handle for name_to_handle_at which clashes with ours */
+#define file_handle linux_file_handle
+#include <fcntl.h>
+#undef file_handle
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 void scanFolder(const path& root, const std::function<void(const path& path)>& lambda, bool recursive = true)
 {
-  TRACE_FS("%p: scanning folder %s", this, root.c_str());
+  TRACE_FS("scanning folder %s", root.c_str());
   
   DIR *d;
   struct dirent *dir;
@@ -127,16 +139,223 @@ bool FileSystem::internalDeleteDirectory(const path& path) const
   return success;
 }
 
-#include <fstream>
+static constexpr size_t COPY_RANGE_SIZE = MB16;
+static constexpr size_t PARALLEL_COPY_THRESHOLD = MB64;
 
-bool FileSystem::copy(const path &from, const path &to) const
+struct copy_range
 {
-  std::ifstream  src(from.str(), std::ios::binary);
-  std::ofstream  dst(to.str(),   std::ios::binary);
-  dst << src.rdbuf();
+  off_t offset;
+  size_t length;
+};
+
+/* copies a range between two descriptors at the same offset, inside the kernel if possible */
+static bool copyRange(int in, int out, off_t offset, size_t length)
+{
+  size_t done = 0;
+
+#if defined(__linux__)
+  while (done < length)
+  {
+    off_t inOffset = offset + done, outOffset = offset + done;
+    ssize_t r = copy_file_range(in, &inOffset, out, &outOffset, length - done, 0);
+
+    if (r > 0)
+      done += r;
+    else if (r < 0 && errno == EINTR)
+      continue;
+    else if (r < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+      break;
+    else
+      return false;
+  }
+#endif
+
+  if (done < length)
+  {
+    std::unique_ptr<byte[]> buffer(new byte[KB256]);
+
+    while (done < length)
+    {
+      ssize_t r = pread(in, buffer.get(), std::min(KB256, length - done), offset + done);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+      else if (r <= 0)
+        return false;
+
+      for (ssize_t written = 0; written < r; )
+      {
+        ssize_t w = pwrite(out, buffer.get() + written, r - written, offset + done + written);
+
+        if (w < 0 && errno == EINTR)
+          continue;
+        else if (w <= 0)
+          return false;
+
+        written += w;
+      }
+
+      done += r;
+    }
+  }
+
   return true;
 }
 
+/* data extents of the file split in ranges, holes are skipped when the platform reports them */
+static std::vector<copy_range> dataRanges(int fd, size_t length, bool sparse)
+{
+  std::vector<copy_range> extents;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  if (sparse)
+  {
+    off_t position = 0;
+
+    while (size_t(position) < length)
+    {
+      off_t data = lseek(fd, position, SEEK_DATA);
+
+      /* no more data, or the filesystem doesn't support the query */
+      if (data < 0)
+      {
+        if (errno != ENXIO)
+          extents.assign(1, { 0, length });
+        break;
+      }
+
+      off_t hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0)
+        hole = length;
+
+      extents.push_back({ data, size_t(hole - data) });
+      position = hole;
+    }
+  }
+  else
+#endif
+    extents.push_back({ 0, length });
+
+  std::vector<copy_range> ranges;
+  for (const copy_range& extent : extents)
+    for (size_t offset = 0; offset < extent.length; offset += COPY_RANGE_SIZE)
+      ranges.push_back({ extent.offset + off_t(offset), std::min(COPY_RANGE_SIZE, extent.length - offset) });
+
+  return ranges;
+}
+
+static bool copyFile(const path& from, const path& to, size_t threads)
+{
+  int in = open(from.c_str(), O_RDONLY);
+  if (in < 0)
+    return false;
+
+  struct stat sb;
+  if (fstat(in, &sb) != 0 || !S_ISREG(sb.st_mode))
+  {
+    close(in);
+    return false;
+  }
+
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, sb.st_mode & 0777);
+  if (out < 0)
+  {
+    close(in);
+    return false;
+  }
+
+  /* open only applies the mode to files it creates, an existing destination keeps its own */
+  fchmod(out, sb.st_mode & 07777);
+
+  const size_t length = sb.st_size;
+  bool success = true;
+
+#if defined(__linux__) && defined(FICLONE)
+  /* shares extents with the source on filesystems supporting it, nothing to copy then */
+  if (ioctl(out, FICLONE, in) == 0)
+  {
+    TRACE_FS("copy %s -> %s (reflink)", from.c_str(), to.c_str());
+    close(in);
+    return close(out) == 0;
+  }
+#endif
+
+  /* less blocks than size means there are holes which must stay such */
+  const bool sparse = size_t(sb.st_blocks) * 512 < length;
+
+#if defined(__linux__)
+  if (!sparse && length > 0)
+    posix_fallocate(out, 0, length);
+#endif
+
+  if (ftruncate(out, length) != 0)
+    success = false;
+
+  const std::vector<copy_range> ranges = dataRanges(in, length, sparse);
+
+  if (success && length >= PARALLEL_COPY_THRESHOLD && threads > 1 && ranges.size() > 1)
+  {
+    std::atomic<bool> failed(false);
+    thread_pool pool(std::min(threads, ranges.size()));
+
+    for (const copy_range& range : ranges)
+      pool.submit([&failed, in, out, range] () {
+        if (!failed && !copyRange(in, out, range.offset, range.length))
+          failed = true;
+      });
+
+    pool.wait();
+    success = !failed;
+  }
+  else if (success)
+  {
+    for (const copy_range& range : ranges)
+      if (!(success = copyRange(in, out, range.offset, range.length)))
+        break;
+  }
+
+  TRACE_FS("copy %s -> %s (%lu bytes, %lu ranges, success: %d)", from.c_str(), to.c_str(), length, ranges.size(), success);
+
+  close(in);
+  success &= close(out) == 0;
+  return success;
+}
+
+bool FileSystem::copy(const path& from, const path& to, size_t threads) const
+{
+  return copyFile(from, to, threads ? threads : thread_pool::defaultConcurrency());
+}
+
+std::vector<bool> FileSystem::copy(const std::vector<std::pair<path, path>>& files, size_t threads, size_t queueDepth) const
+{
+  if (threads == 0)
+    threads = thread_pool::defaultConcurrency();
+  if (queueDepth == 0)
+    queueDepth = threads * 2;
+
+  /* vector<bool> elements can't be written concurrently */
+  std::vector<char> results(files.size(), false);
+  bounded_queue<size_t> queue(queueDepth);
+
+  {
+    thread_pool pool(threads);
+
+    for (size_t i = 0; i < threads; ++i)
+      pool.submit([&] () {
+        size_t index;
+        while (queue.pop(index))
+          results[index] = copyFile(files[index].first, files[index].second, 1);
+      });
+
+    for (size_t i = 0; i < files.size(); ++i)
+      queue.push(size_t(i));
+
+    queue.close();
+  }
+
+  return std::vector<bool>(results.begin(), results.end());
+}
+
 bool FileSystem::deleteFile(const path& path) const
 {
   TRACE_FS("%p: deleting file %s", this, path.c_str());
@@ -149,9 +368,13 @@ bool FileSystem::deleteFile(const path& path) const
 bool FileSystem::fallocate(const path &path, size_t aLength) const
 {
   file_handle handle(path, file_mode::WRITING);
+  
+  if (!handle)
+    return false;
+  
   int fd = handle.fd();
   
-#if defined(HAVE_POSIX_FALLOCATE)
+#if defined(HAVE_POSIX_FALLOCATE) || defined(__linux__)
   return posix_fallocate(fd, 0, aLength) == 0;
 #elif defined(XP_WIN)
   return PR_Seek64(aFD, aLength, PR_SEEK_SET) == aLength
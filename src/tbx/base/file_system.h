@@ -19,11 +19,17 @@ public:
   bool existsAsFolder(const path& path) const;
   bool existsAsFile(const path& path) const;
   
-  bool copy(const path& from, const path& to) const;
+  /* copies through reflink when supported, otherwise inside the kernel preserving holes,
+     large files are split in ranges copied by up to threads workers, 0 means default */
+  bool copy(const path& from, const path& to, size_t threads = 0) const;
+  /* copies every pair concurrently keeping at most queueDepth files in flight,
+     returns the outcome of each copy in the same order */
+  std::vector<bool> copy(const std::vector<std::pair<path, path>>& files, size_t threads = 0, size_t queueDepth = 0) const;
   
   bool createFolder(const path& folder, bool intermediate = true) const;
   
   bool deleteFile(const path& path) const;
   
+  /* creates or truncates path and reserves size bytes of disk space for it */
   bool fallocate(const path& path, size_t size) const;
 };
@@ -6,6 +6,24 @@
 #include <sys/stat.h>
 #include <dirent.h>
 
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+#if !_WIN32
+#include <unistd.h>
+#include <sys/uio.h>
+/* glibc declares a struct file_handle for name_to_handle_at which clashes with ours */
+#define file_handle linux_file_handle
+#include <fcntl.h>
+#undef file_handle
+#endif
+
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "file_system.h"
 
 static constexpr const char SEPARATOR = '/';
@@ -117,3 +135,269 @@ size_t path::length() const
   stat(_data.c_str(), &sb);
   return sb.st_size;
 }
+
+size_t file_handle::write(const io_vector* parts, size_t count) const
+{
+  assert(_file);
+#ifdef _WIN32
+  size_t done = 0;
+  for (size_t i = 0; i < count; ++i)
+    done += write(parts[i].data, 1, parts[i].length);
+  return done;
+#else
+  fflush(_file);
+  const long start = ftell(_file);
+  
+  size_t done = 0;
+  std::vector<iovec> batch;
+  
+  for (size_t i = 0; i < count; )
+  {
+    const size_t consumed = std::min(count - i, size_t(IOV_MAX));
+    
+    batch.clear();
+    for (size_t j = i; j < i + consumed; ++j)
+      if (parts[j].length)
+        batch.push_back({ const_cast<void*>(parts[j].data), parts[j].length });
+    
+    /* partial writes resume from the first buffer which wasn't completely written */
+    size_t pending = 0;
+    for (const iovec& v : batch)
+      pending += v.iov_len;
+    
+    size_t written = 0;
+    while (written < pending)
+    {
+      ssize_t r = ::writev(fileno(_file), batch.data(), int(batch.size()));
+      if (r < 0 && errno == EINTR)
+        continue;
+      else if (r <= 0)
+      {
+        fseek(_file, start + done + written, SEEK_SET);
+        return done + written;
+      }
+      
+      written += r;
+      
+      while (!batch.empty() && size_t(r) >= batch.front().iov_len)
+      {
+        r -= batch.front().iov_len;
+        batch.erase(batch.begin());
+      }
+      
+      if (!batch.empty())
+      {
+        batch.front().iov_base = static_cast<char*>(batch.front().iov_base) + r;
+        batch.front().iov_len -= r;
+      }
+    }
+    
+    done += written;
+    i += consumed;
+  }
+  
+  /* stream position must follow what has been written on the descriptor */
+  fseek(_file, start + done, SEEK_SET);
+  return done;
+#endif
+}
+
+size_t file_handle::readAt(void* ptr, size_t amount, long offset) const
+{
+  assert(_file);
+#ifdef _WIN32
+  long mark = tell();
+  seek(offset, SEEK_SET);
+  size_t r = read(ptr, 1, amount);
+  seek(mark, SEEK_SET);
+  return r;
+#else
+  size_t done = 0;
+  while (done < amount)
+  {
+    ssize_t r = pread(fileno(_file), static_cast<char*>(ptr) + done, amount - done, offset + done);
+    if (r > 0)
+      done += r;
+    else if (r == 0 || errno != EINTR)
+      break;
+  }
+  return done;
+#endif
+}
+
+size_t file_handle::writeAt(const void* ptr, size_t amount, long offset) const
+{
+  assert(_file);
+#ifdef _WIN32
+  long mark = tell();
+  seek(offset, SEEK_SET);
+  size_t r = write(ptr, 1, amount);
+  seek(mark, SEEK_SET);
+  return r;
+#else
+  fflush(_file);
+  
+  size_t done = 0;
+  while (done < amount)
+  {
+    ssize_t r = pwrite(fileno(_file), static_cast<const char*>(ptr) + done, amount - done, offset + done);
+    if (r > 0)
+      done += r;
+    else if (r == 0 || errno != EINTR)
+      break;
+  }
+  return done;
+#endif
+}
+
+bool file_handle::preallocate(size_t size) const
+{
+  assert(_file);
+#if __linux__
+  int r;
+  while ((r = fallocate(fileno(_file), FALLOC_FL_KEEP_SIZE, 0, size)) != 0 && errno == EINTR) ;
+  return r == 0;
+#else
+  return false;
+#endif
+}
+
+bool file_handle::truncate(size_t size) const
+{
+  assert(_file);
+#ifdef _WIN32
+  fflush(_file);
+  return _chsize_s(_fileno(_file), size) == 0;
+#else
+  fflush(_file);
+  return ftruncate(fileno(_file), size) == 0;
+#endif
+}
+
+size_t file_handle::transfer(const file_handle& dest, size_t amount) const
+{
+  assert(_file && dest._file);
+#if __linux__
+  fflush(_file);
+  fflush(dest._file);
+  
+  const int in = fileno(_file), out = fileno(dest._file);
+  const off_t inStart = ftell(_file), outStart = ftell(dest._file);
+  
+  off_t inOffset = inStart, outOffset = outStart;
+  size_t done = 0;
+  bool copyRange = true;
+  
+  while (done < amount)
+  {
+    ssize_t r;
+    
+    if (copyRange)
+      r = copy_file_range(in, &inOffset, out, &outOffset, amount - done, 0);
+    else
+      r = sendfile(out, in, &inOffset, amount - done);
+    
+    if (r > 0)
+    {
+      done += r;
+      if (!copyRange)
+        outOffset += r;
+    }
+    else if (r < 0 && errno == EINTR)
+      continue;
+    /* unsupported by kernel or filesystem, or across filesystems on older kernels */
+    else if (r < 0 && copyRange && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+    {
+      copyRange = false;
+      lseek(out, outOffset, SEEK_SET);
+    }
+    else
+      break;
+  }
+  
+  fseek(_file, inStart + done, SEEK_SET);
+  fseek(dest._file, outStart + done, SEEK_SET);
+  return done;
+#else
+  return 0;
+#endif
+}
+
+#if !_WIN32
+int descriptor::open(const path& path, mode mode, bool* direct)
+{
+  int flags = O_CLOEXEC;
+  if (mode == mode::READING) flags |= O_RDONLY;
+  else if (mode == mode::WRITING) flags |= O_WRONLY | O_CREAT | O_TRUNC;
+  else flags |= O_RDWR | O_CREAT;
+  
+  int fd = -1;
+  
+  if (direct)
+  {
+#if defined(O_DIRECT)
+    fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+    *direct = fd >= 0;
+    if (fd < 0 && errno != EINVAL)
+      return fd;
+#else
+    *direct = false;
+#endif
+  }
+  
+  if (fd < 0)
+    fd = ::open(path.c_str(), flags, 0644);
+  
+  return fd;
+}
+
+bool descriptor::setNonBlocking(int fd)
+{
+  const int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+int descriptor::allocate(int fd, uint64_t offset, uint64_t length)
+{
+  int r = EOPNOTSUPP;
+  
+#if __linux__
+  while ((r = posix_fallocate(fd, offset, length)) == EINTR) ;
+#endif
+  
+  /* file systems or platforms without allocation support are extended sparsely */
+  if (r == EOPNOTSUPP || r == EINVAL)
+  {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      r = errno;
+    else if (uint64_t(st.st_size) >= offset + length)
+      r = 0;
+    else
+      r = ftruncate(fd, offset + length) == 0 ? 0 : errno;
+  }
+  
+  return r;
+}
+
+void descriptor::writeback(int fd, uint64_t offset, uint64_t length, bool wait)
+{
+#if __linux__
+  const unsigned int flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE;
+  sync_file_range(fd, offset, length, flags);
+#else
+  if (wait)
+    fdatasync(fd);
+#endif
+}
+
+bool descriptor::drop(int fd, uint64_t offset, uint64_t length)
+{
+#if defined(POSIX_FADV_DONTNEED)
+  return posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED) == 0;
+#else
+  return false;
+#endif
+}
+
+#endif
@@ -5,6 +5,8 @@
 #include <unordered_set>
 #include <functional>
 #include <memory>
+#include <cstdio>
+#include <cstdint>
 
 #if _WIN32
 #include <codecvt>
@@ -94,6 +96,12 @@ enum class file_mode
 };
 
 
+struct io_vector
+{
+  const void* data;
+  size_t length;
+};
+
 class file_handle
 {
 private:
@@ -130,6 +138,30 @@ public:
     return r;
   }
   
+  /* gather write of count buffers at the current position with as few syscalls as possible,
+     buffered data is flushed first, returns bytes written */
+  size_t write(const io_vector* parts, size_t count) const;
+  
+  /* positional read on the underlying descriptor, doesn't move the stream position and can be
+     issued concurrently from multiple threads on the same handle, returns bytes read */
+  size_t readAt(void* ptr, size_t amount, long offset) const;
+  
+  /* positional write counterpart of readAt, buffered data is flushed first, returns bytes written */
+  size_t writeAt(const void* ptr, size_t amount, long offset) const;
+  
+  /* reserves disk space for size bytes without changing the file length so that
+     data written later is laid out contiguously, false if not supported */
+  bool preallocate(size_t size) const;
+  
+  /* sets file length, space preallocated past it is released */
+  bool truncate(size_t size) const;
+  
+  /* copies up to amount bytes from the current position of this handle to the current position
+     of dest inside the kernel, copy_file_range is tried first, which shares extents on filesystems
+     supporting reflinks, then sendfile, both positions are advanced by the bytes copied which are
+     returned, less than amount is copied at end of file or if no kernel path is available */
+  size_t transfer(const file_handle& dest, size_t amount) const;
+  
   void seek(long offset, int origin) const {
     assert(_file);
     fseek(_file, offset, origin);
@@ -209,4 +241,28 @@ public:
   }
 };
 
+#if !_WIN32
+/* descriptor level calls for streams working below file_handle, defined in path.cpp so that
+   <fcntl.h> doesn't leak into clients, where its struct file_handle clashes with ours */
+namespace descriptor
+{
+  enum class mode { READING, WRITING, UPDATING };
+  
+  /* close on exec, WRITING creates and truncates, UPDATING creates without truncating, when direct
+     is passed O_DIRECT is requested and direct is cleared if the file system refuses it */
+  int open(const path& path, mode mode, bool* direct = nullptr);
+  
+  bool setNonBlocking(int fd);
+  
+  /* allocates disk space extending the file, sparse extension if not supported, 0 or errno */
+  int allocate(int fd, uint64_t offset, uint64_t length);
+  
+  /* starts writeback of a range, wait blocks until it's on disk */
+  void writeback(int fd, uint64_t offset, uint64_t length, bool wait);
+  
+  /* evicts a clean range from the page cache, false where not supported */
+  bool drop(int fd, uint64_t offset, uint64_t length);
+}
+#endif
+
 using path_extension = std::string;
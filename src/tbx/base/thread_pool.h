@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cassert>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+/* fixed set of worker threads consuming a FIFO of tasks, tasks submitted after
+   destruction started are rejected, destructor waits for pending tasks */
+class thread_pool
+{
+private:
+  std::vector<std::thread> _workers;
+  std::deque<std::function<void()>> _tasks;
+
+  std::mutex _mutex;
+  std::condition_variable _available;
+  std::condition_variable _idle;
+
+  size_t _active;
+  bool _stopping;
+
+  void loop()
+  {
+    for (;;)
+    {
+      std::function<void()> task;
+
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _available.wait(lock, [this] () { return _stopping || !_tasks.empty(); });
+
+        if (_tasks.empty())
+          return;
+
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+        ++_active;
+      }
+
+      task();
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        --_active;
+        if (_active == 0 && _tasks.empty())
+          _idle.notify_all();
+      }
+    }
+  }
+
+public:
+  static size_t defaultConcurrency()
+  {
+    size_t count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+  }
+
+  thread_pool(size_t count = defaultConcurrency()) : _active(0), _stopping(false)
+  {
+    assert(count > 0);
+    _workers.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+      _workers.emplace_back([this] () { loop(); });
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  ~thread_pool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+
+    _available.notify_all();
+    for (std::thread& worker : _workers)
+      worker.join();
+  }
+
+  template<typename F>
+  auto submit(F&& f) -> std::future<decltype(f())>
+  {
+    using result_t = decltype(f());
+    auto task = std::make_shared<std::packaged_task<result_t()>>(std::forward<F>(f));
+    std::future<result_t> future = task->get_future();
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      assert(!_stopping);
+      _tasks.emplace_back([task] () { (*task)(); });
+    }
+
+    _available.notify_one();
+    return future;
+  }
+
+  /* blocks until every submitted task has completed */
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this] () { return _active == 0 && _tasks.empty(); });
+  }
+
+  size_t size() const { return _workers.size(); }
+};
+
+/* blocking FIFO with a maximum capacity, once closed pushes are rejected
+   and pops drain the remaining elements before failing */
+template<typename T>
+class bounded_queue
+{
+private:
+  std::deque<T> _data;
+  size_t _capacity;
+  bool _closed;
+
+  mutable std::mutex _mutex;
+  std::condition_variable _notFull;
+  std::condition_variable _notEmpty;
+
+public:
+  bounded_queue(size_t capacity) : _capacity(capacity), _closed(false) { assert(capacity > 0); }
+
+  bool push(T&& value)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notFull.wait(lock, [this] () { return _closed || _data.size() < _capacity; });
+
+    if (_closed)
+      return false;
+
+    _data.push_back(std::move(value));
+    lock.unlock();
+    _notEmpty.notify_one();
+    return true;
+  }
+
+  bool pop(T& value)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notEmpty.wait(lock, [this] () { return _closed || !_data.empty(); });
+
+    if (_data.empty())
+      return false;
+
+    value = std::move(_data.front());
+    _data.pop_front();
+    lock.unlock();
+    _notFull.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+
+    _notFull.notify_all();
+    _notEmpty.notify_all();
+  }
+
+  bool closed() const { std::lock_guard<std::mutex> lock(_mutex); return _closed; }
+  size_t size() const { std::lock_guard<std::mutex> lock(_mutex); return _data.size(); }
+  size_t capacity() const { return _capacity; }
+};
@@ -0,0 +1,390 @@
+#include "tracer.h"
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace tracer
+{
+  static constexpr uint32_t DEFAULT_MASK =
+    (TRACE_MEMORY_BUFFERS ? uint32_t(MEMORY_BUFFERS) : 0) |
+    (TRACE_PIPES ? uint32_t(PIPES) : 0) |
+    (TRACE_FILES ? uint32_t(FILES) : 0) |
+    (TRACE_FILE_SYSTEM ? uint32_t(FILE_SYSTEM) : 0) |
+    (TRACE_ARCHIVE >= 1 ? uint32_t(ARCHIVE) : 0) |
+    (TRACE_ARCHIVE >= 2 ? uint32_t(ARCHIVE_DETAIL) : 0) |
+    (TRACE_ARCHIVE_BUILDER ? uint32_t(ARCHIVE_BUILDER) : 0) |
+    (TRACE_ENABLED ? uint32_t(GENERAL) : 0);
+
+  std::atomic<uint32_t> mask(DEFAULT_MASK);
+  std::atomic<uint32_t> echo(DEFAULT_MASK);
+
+  static constexpr char MAGIC[8] = { 'T', 'B', 'X', 'T', 'R', 'A', 'C', 'E' };
+
+  /* written only by its thread, read by dump which validates events through their sequence */
+  struct ring
+  {
+    std::unique_ptr<event[]> events;
+    size_t capacity;
+    uint32_t thread;
+    std::atomic<uint64_t> head;
+
+    ring(size_t capacity, uint32_t thread) : events(new event[capacity]), capacity(capacity), thread(thread), head(0)
+    {
+      for (size_t i = 0; i < capacity; ++i)
+        events[i].sequence = 0;
+    }
+  };
+
+  struct registry
+  {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ring>> rings;
+    std::atomic<size_t> capacity;
+    std::chrono::steady_clock::time_point origin;
+
+    registry() : capacity(4096), origin(std::chrono::steady_clock::now()) { }
+  };
+
+  static registry& instance()
+  {
+    static registry registry;
+    return registry;
+  }
+
+  static ring& local()
+  {
+    /* rings are owned by the registry too so events of finished threads can still be dumped */
+    static thread_local std::shared_ptr<ring> local;
+
+    if (!local)
+    {
+      registry& r = instance();
+      std::lock_guard<std::mutex> lock(r.mutex);
+
+      local = std::make_shared<ring>(utils::nextPowerOfTwo(std::max(size_t(16), r.capacity.load())), uint32_t(r.rings.size()));
+      r.rings.push_back(local);
+    }
+
+    return *local;
+  }
+
+  void setRingCapacity(size_t events) { instance().capacity = events; }
+
+  event& begin(uint32_t category, const char* format)
+  {
+    ring& r = local();
+    const uint64_t index = r.head.load(std::memory_order_relaxed);
+    event& e = r.events[index & (r.capacity - 1)];
+
+    /* invalidate the slot while it's being overwritten */
+    e.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    e.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - instance().origin).count();
+    e.format = format;
+    e.category = category;
+    e.thread = r.thread;
+    e.count = 0;
+    e.textUsed = 0;
+
+    return e;
+  }
+
+  void commit(event& e)
+  {
+    ring& r = local();
+    const uint64_t index = r.head.load(std::memory_order_relaxed);
+
+    e.sequence.store(index + 1, std::memory_order_release);
+    r.head.store(index + 1, std::memory_order_release);
+  }
+
+  void hidden::print(const char* format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    va_list copy;
+    va_copy(copy, args);
+    const int length = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+
+    std::vector<char> buffer(std::max(length, 0) + 1);
+    vsnprintf(buffer.data(), buffer.size(), format, args);
+    va_end(args);
+
+    printf("%s\n", buffer.data());
+  }
+
+  std::string render(const event& e, const char* format)
+  {
+    std::string result;
+    size_t arg = 0;
+    char buffer[256];
+
+    for (const char* p = format; *p; )
+    {
+      if (*p != '%')
+      {
+        result += *p++;
+        continue;
+      }
+      else if (p[1] == '%')
+      {
+        result += '%';
+        p += 2;
+        continue;
+      }
+
+      /* flags, width and precision are kept while length modifiers are normalized */
+      std::string spec = "%";
+      ++p;
+      while (*p && strchr("-+ #0123456789.*", *p))
+        spec += *p++;
+      while (*p && strchr("hljztLq", *p))
+        ++p;
+
+      const char conversion = *p ? *p++ : 'd';
+      const uint64_t value = arg < e.count ? e.args[arg] : 0;
+      const bool missing = arg++ >= e.count;
+
+      if (missing)
+      {
+        result += "?";
+        continue;
+      }
+
+      switch (conversion)
+      {
+        case 's':
+          snprintf(buffer, sizeof(buffer), (spec + 's').c_str(), value < TEXT_SIZE ? e.text + value : "...");
+          break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        {
+          double v;
+          memcpy(&v, &value, sizeof(v));
+          snprintf(buffer, sizeof(buffer), (spec + conversion).c_str(), v);
+          break;
+        }
+        case 'p':
+          snprintf(buffer, sizeof(buffer), (spec + 'p').c_str(), reinterpret_cast<void*>(value));
+          break;
+        case 'c':
+          snprintf(buffer, sizeof(buffer), (spec + 'c').c_str(), int(value));
+          break;
+        case 'd': case 'i':
+          snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(), static_cast<long long>(value));
+          break;
+        default:
+          snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(), static_cast<unsigned long long>(value));
+          break;
+      }
+
+      result += buffer;
+    }
+
+    return result;
+  }
+
+  /* dumped events have their format pointer replaced by an index in the format table */
+  struct stored_event
+  {
+    uint64_t timestamp;
+    uint64_t format;
+    uint32_t category;
+    uint32_t thread;
+    uint64_t args[MAX_ARGS];
+    uint8_t count;
+    char text[TEXT_SIZE];
+  };
+
+  bool dump(const char* path)
+  {
+    std::vector<std::shared_ptr<ring>> rings;
+
+    {
+      registry& r = instance();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      rings = r.rings;
+    }
+
+    std::vector<stored_event> events;
+    std::vector<const char*> formats;
+    std::unordered_map<const char*, uint64_t> indices;
+
+    for (const auto& r : rings)
+    {
+      const uint64_t head = r->head.load(std::memory_order_acquire);
+      const uint64_t first = head > r->capacity ? head - r->capacity : 0;
+
+      for (uint64_t i = first; i < head; ++i)
+      {
+        const event& e = r->events[i & (r->capacity - 1)];
+
+        /* skip events overwritten while copying */
+        if (e.sequence.load(std::memory_order_acquire) != i + 1)
+          continue;
+
+        stored_event s;
+        s.timestamp = e.timestamp;
+        s.category = e.category;
+        s.thread = e.thread;
+        s.count = e.count;
+        memcpy(s.args, e.args, sizeof(s.args));
+        memcpy(s.text, e.text, sizeof(s.text));
+        const char* format = e.format;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (e.sequence.load(std::memory_order_relaxed) != i + 1)
+          continue;
+
+        auto it = indices.find(format);
+        if (it == indices.end())
+        {
+          it = indices.emplace(format, formats.size()).first;
+          formats.push_back(format);
+        }
+
+        s.format = it->second;
+        events.push_back(s);
+      }
+    }
+
+    std::sort(events.begin(), events.end(), [] (const stored_event& a, const stored_event& b) { return a.timestamp < b.timestamp; });
+
+    FILE* out = fopen(path, "wb");
+    if (!out)
+      return false;
+
+    uint64_t count = formats.size();
+    bool success = fwrite(MAGIC, sizeof(MAGIC), 1, out) == 1 && fwrite(&count, sizeof(count), 1, out) == 1;
+
+    for (const char* format : formats)
+    {
+      uint32_t length = uint32_t(strlen(format));
+      success &= fwrite(&length, sizeof(length), 1, out) == 1 && fwrite(format, 1, length, out) == length;
+    }
+
+    count = events.size();
+    success &= fwrite(&count, sizeof(count), 1, out) == 1;
+    success &= fwrite(events.data(), sizeof(stored_event), events.size(), out) == events.size();
+
+    return (fclose(out) == 0) && success;
+  }
+
+  static const char* categoryName(uint32_t category)
+  {
+    switch (category)
+    {
+      case MEMORY_BUFFERS: return "memory_buffers";
+      case PIPES: return "pipes";
+      case FILES: return "files";
+      case FILE_SYSTEM: return "file_system";
+      case ARCHIVE: return "archive";
+      case ARCHIVE_DETAIL: return "archive_detail";
+      case ARCHIVE_BUILDER: return "archive_builder";
+      default: return "general";
+    }
+  }
+
+  static std::string escape(const std::string& text)
+  {
+    std::string result;
+    for (char c : text)
+    {
+      if (c == '"' || c == '\\')
+        result += '\\';
+      if (static_cast<unsigned char>(c) >= 0x20)
+        result += c;
+    }
+    return result;
+  }
+
+  bool decode(const char* input, const char* output, output_format format)
+  {
+    FILE* in = fopen(input, "rb");
+    if (!in)
+      return false;
+
+    /* counts and lengths come from the file, they're bounded by what's left in it */
+    fseek(in, 0, SEEK_END);
+    const uint64_t fileSize = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    const auto remaining = [in, fileSize] () { return fileSize - std::min(fileSize, uint64_t(ftell(in))); };
+
+    char magic[sizeof(MAGIC)];
+    uint64_t count = 0;
+    std::vector<std::string> formats;
+    std::vector<stored_event> events;
+
+    bool success = fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 && fread(&count, sizeof(count), 1, in) == 1;
+
+    for (uint64_t i = 0; success && i < count; ++i)
+    {
+      uint32_t length;
+      success = fread(&length, sizeof(length), 1, in) == 1 && length <= remaining();
+
+      std::string text(success ? length : 0, '\0');
+      success = success && fread(&text[0], 1, length, in) == length;
+      formats.push_back(text);
+    }
+
+    success = success && fread(&count, sizeof(count), 1, in) == 1 && count <= remaining() / sizeof(stored_event);
+    if (success)
+    {
+      events.resize(count);
+      success = fread(events.data(), sizeof(stored_event), count, in) == count;
+    }
+
+    fclose(in);
+
+    if (!success)
+      return false;
+
+    FILE* out = fopen(output, "wb");
+    if (!out)
+      return false;
+
+    if (format == output_format::CHROME_JSON)
+      fputs("{\"traceEvents\":[\n", out);
+
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+      const stored_event& s = events[i];
+
+      event e;
+      e.count = std::min(s.count, uint8_t(MAX_ARGS));
+      memcpy(e.args, s.args, sizeof(e.args));
+      memcpy(e.text, s.text, sizeof(e.text));
+      e.text[TEXT_SIZE - 1] = '\0';
+
+      const std::string text = render(e, s.format < formats.size() ? formats[s.format].c_str() : "");
+
+      if (format == output_format::TEXT)
+        fprintf(out, "%12.3f [%u] %s: %s\n", s.timestamp / 1000.0, s.thread, categoryName(s.category), text.c_str());
+      else
+        fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+                i ? ",\n" : "", escape(text).c_str(), categoryName(s.category), s.timestamp / 1000.0, s.thread);
+    }
+
+    if (format == output_format::CHROME_JSON)
+      fputs("\n]}\n", out);
+
+    return fclose(out) == 0;
+  }
+
+  void clear()
+  {
+    registry& r = instance();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    /* rings of live threads are still referenced by them, their content is just skipped */
+    for (const auto& ring : r.rings)
+      for (size_t i = 0; i < ring->capacity; ++i)
+        ring->events[i].sequence = 0;
+  }
+}
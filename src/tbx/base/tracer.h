@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/* binary event tracer backing the TRACE_* macros, each thread records fixed size events in its
+   own ring buffer without locking, arguments are stored raw and formatted only when events are
+   rendered by the decoder of dumped traces, strings are truncated to fit the event, echoed events
+   are instead formatted from the original arguments, categories are switched at runtime so
+   tracing can stay compiled in, a disabled category costs a relaxed load and a test */
+namespace tracer
+{
+  enum category : uint32_t
+  {
+    MEMORY_BUFFERS = 1 << 0,
+    PIPES = 1 << 1,
+    FILES = 1 << 2,
+    FILE_SYSTEM = 1 << 3,
+    ARCHIVE = 1 << 4,
+    ARCHIVE_DETAIL = 1 << 5,
+    ARCHIVE_BUILDER = 1 << 6,
+    GENERAL = 1 << 7,
+
+    NONE = 0,
+    ALL = 0xFFFFFFFF
+  };
+
+  enum class output_format
+  {
+    TEXT,
+    CHROME_JSON
+  };
+
+  static constexpr size_t MAX_ARGS = 6;
+  static constexpr size_t TEXT_SIZE = 46;
+
+  /* string arguments are copied in text and their argument is the offset in it */
+  struct event
+  {
+    std::atomic<uint64_t> sequence;
+    uint64_t timestamp;
+    const char* format;
+    uint32_t category;
+    uint32_t thread;
+    uint64_t args[MAX_ARGS];
+    uint8_t count;
+    uint8_t textUsed;
+    char text[TEXT_SIZE];
+  };
+
+  static_assert(sizeof(event) == 128, "");
+
+  extern std::atomic<uint32_t> mask;
+  /* categories whose events are also printed, defaults to the ones enabled at compile time */
+  extern std::atomic<uint32_t> echo;
+
+  inline bool enabled(uint32_t categories) { return (mask.load(std::memory_order_relaxed) & categories) != 0; }
+  inline void enable(uint32_t categories) { mask |= categories; }
+  inline void disable(uint32_t categories) { mask &= ~categories; }
+
+  /* events of echoed categories are also printed synchronously and in full as the old macros did */
+  inline void setEcho(uint32_t categories) { echo = categories; }
+
+  /* events each thread ring can hold before overwriting the oldest, applies to rings created later */
+  void setRingCapacity(size_t events);
+
+  event& begin(uint32_t category, const char* format);
+  void commit(event& e);
+
+  /* renders a single event with its format string */
+  std::string render(const event& e, const char* format);
+
+  /* writes every event still in the rings to path, formats are stored along so that
+     the dump can be decoded by another process */
+  bool dump(const char* path);
+  bool decode(const char* input, const char* output, output_format format);
+
+  /* drops every recorded event */
+  void clear();
+
+  namespace hidden
+  {
+    inline void append(event& e, const char* value)
+    {
+      if (!value)
+        value = "(null)";
+
+      const size_t length = std::min(strlen(value), TEXT_SIZE - 1 - e.textUsed);
+      memcpy(e.text + e.textUsed, value, length);
+      e.text[e.textUsed + length] = '\0';
+
+      e.args[e.count++] = e.textUsed;
+      e.textUsed += length + 1;
+    }
+
+    inline void pack(event& e, const char* value) { if (e.textUsed < TEXT_SIZE) append(e, value); else e.args[e.count++] = TEXT_SIZE; }
+    inline void pack(event& e, char* value) { pack(e, static_cast<const char*>(value)); }
+    inline void pack(event& e, const std::string& value) { pack(e, value.c_str()); }
+
+    template<typename T, typename std::enable_if<std::is_floating_point<T>::value, int>::type = 0>
+    inline void pack(event& e, T value) { double v = value; memcpy(&e.args[e.count++], &v, sizeof(v)); }
+
+    template<typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    inline void pack(event& e, T value) { e.args[e.count++] = static_cast<uint64_t>(value); }
+
+    template<typename T, typename std::enable_if<std::is_enum<T>::value, int>::type = 0>
+    inline void pack(event& e, T value) { e.args[e.count++] = static_cast<uint64_t>(value); }
+
+    template<typename T>
+    inline void pack(event& e, const T* value) { e.args[e.count++] = reinterpret_cast<uintptr_t>(value); }
+
+    inline void packAll(event&) { }
+
+    /* formats and prints a line like debugprintf without limiting its length */
+    void print(const char* format, ...);
+
+    template<typename T> inline const T& printable(const T& value) { return value; }
+    inline const char* printable(const std::string& value) { return value.c_str(); }
+
+    template<typename T, typename... Args>
+    inline void packAll(event& e, const T& value, const Args&... args)
+    {
+      if (e.count < MAX_ARGS)
+      {
+        pack(e, value);
+        packAll(e, args...);
+      }
+    }
+  }
+
+  template<typename... Args>
+  void record(uint32_t category, const char* format, const Args&... args)
+  {
+    event& e = begin(category, format);
+    hidden::packAll(e, args...);
+    commit(e);
+
+    if (echo.load(std::memory_order_relaxed) & category)
+      hidden::print(format, hidden::printable(args)...);
+  }
+}
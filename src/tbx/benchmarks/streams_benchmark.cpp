@@ -0,0 +1,486 @@
+#include "tbx/base/common.h"
+#include "tbx/streams/data_source.h"
+#include "tbx/streams/data_filter.h"
+#include "tbx/streams/data_pipe.h"
+#include "tbx/streams/memory_buffer.h"
+#include "tbx/streams/file_data_source.h"
+#include "tbx/streams/filter_chain.h"
+#include "tbx/streams/mmap_data_sink.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+/* throughput benchmarks of the streams layer, every case moves the same amount of data and is
+   repeated, the best run is kept, file cases are run both with the file evicted from the page
+   cache and with it resident, results are printed as a table and written as JSON
+
+   usage: streams_benchmark [--quick] [--size MB] [--repeat N] [--dir folder] [--output file.json] */
+
+namespace bench
+{
+  using clock = std::chrono::steady_clock;
+
+  struct options
+  {
+    size_t size = MB256;
+    size_t repeat = 3;
+    bool quick = false;
+    std::string folder = "/tmp";
+    std::string output = "streams_benchmark.json";
+  };
+
+  struct result
+  {
+    std::string group;
+    std::string name;
+    std::string cache;
+    size_t bufferSize = 0;
+    size_t callSize = 0;
+    size_t depth = 0;
+    size_t bytes = 0;
+    double seconds = 0.0;
+    u64 syscalls = 0;
+
+    double throughput() const { return seconds > 0 ? bytes / seconds / 1e9 : 0.0; }
+    double syscallsPerMB() const { return bytes ? syscalls / (bytes / double(MB1)) : 0.0; }
+  };
+
+  /* read and write syscalls issued by the process so far, 0 where not available */
+  u64 syscalls()
+  {
+#if defined(__linux__)
+    FILE* in = fopen("/proc/self/io", "r");
+    if (!in)
+      return 0;
+
+    char line[128];
+    u64 total = 0, value = 0;
+
+    while (fgets(line, sizeof(line), in))
+    {
+      if (sscanf(line, "syscr: %lu", &value) == 1 || sscanf(line, "syscw: %lu", &value) == 1)
+        total += value;
+    }
+
+    fclose(in);
+    return total;
+#else
+    return 0;
+#endif
+  }
+
+  /* flushes and evicts the file from the page cache, returns false where not supported */
+  bool evict(const path& file)
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = descriptor::open(file, descriptor::mode::READING);
+    if (fd < 0)
+      return false;
+
+    descriptor::writeback(fd, 0, 0, true);
+    bool success = descriptor::drop(fd, 0, 0);
+    ::close(fd);
+    return success;
+#else
+    return false;
+#endif
+  }
+
+  /* copies from in to out, used to measure the cost of the filter machinery alone */
+  class copy_filter : public data_filter
+  {
+  public:
+    copy_filter(size_t bufferSize = KB16) : data_filter(bufferSize) { }
+
+    void init() override { }
+
+    void process() override
+    {
+      size_t effective = std::min(_in.used(), _out.available());
+      memcpy(_out.tail(), _in.head(), effective);
+      _in.consume(effective);
+      _out.advance(effective);
+
+      if (ended() && _in.empty())
+        markFinished();
+    }
+
+    void finalize() override { }
+
+    std::string name() override { return "copy"; }
+  };
+
+  class runner
+  {
+  private:
+    options _options;
+    std::vector<result> _results;
+
+    memory_buffer _data;
+    path _source;
+    path _destination;
+
+    static constexpr const char* WARM = "warm";
+    static constexpr const char* COLD = "cold";
+
+  public:
+    runner(const options& options) : _options(options), _data(options.size),
+    _source(path(options.folder).append("tbx_bench_source.bin")), _destination(path(options.folder).append("tbx_bench_destination.bin")) { }
+
+    ~runner()
+    {
+      std::remove(_source.c_str());
+      std::remove(_destination.c_str());
+    }
+
+    void prepare()
+    {
+      /* xorshift content so that nothing along the way can take shortcuts on zeroes */
+      u64 state = 0x9E3779B97F4A7C15ULL;
+      for (size_t i = 0; i + sizeof(u64) <= _options.size; i += sizeof(u64))
+      {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        memcpy(_data.raw() + i, &state, sizeof(u64));
+      }
+      _data.advance(_options.size);
+
+      file_handle handle(_source, file_mode::WRITING);
+      if (!handle || handle.write(_data.raw(), 1, _data.size()) != _data.size())
+        throw exceptions::messaged_exception(fmt::sprintf("streams_benchmark: unable to write %s", _source.c_str()));
+    }
+
+    /* runs body repeat times and records the best run, cold runs evict the source file before each one */
+    void measure(result r, std::function<size_t()> body)
+    {
+      const bool cold = r.cache == COLD;
+      r.seconds = 0;
+
+      for (size_t i = 0; i < _options.repeat; ++i)
+      {
+        if (cold && !evict(_source))
+          return;
+
+        u64 calls = syscalls();
+        auto mark = clock::now();
+
+        size_t bytes = body();
+
+        double seconds = std::chrono::duration<double>(clock::now() - mark).count();
+        calls = syscalls() - calls;
+
+        if (bytes != _options.size)
+          throw exceptions::messaged_exception(fmt::sprintf("streams_benchmark: %s/%s moved %lu bytes instead of %lu", r.group, r.name, bytes, _options.size));
+
+        if (i == 0 || seconds < r.seconds)
+        {
+          r.seconds = seconds;
+          r.syscalls = calls;
+        }
+      }
+
+      r.bytes = _options.size;
+      _results.push_back(r);
+
+      fprintf(stderr, "%-22s %-16s %-5s buffer %8s call %8s depth %2lu  %7.3f GB/s  %9.2f syscalls/MB\n",
+              r.group.c_str(), r.name.c_str(), r.cache.c_str(), strings::humanReadableSize(r.bufferSize, false, 0).c_str(),
+              strings::humanReadableSize(r.callSize, false, 0).c_str(), r.depth, r.throughput(), r.syscallsPerMB());
+    }
+
+    std::vector<size_t> sizes(size_t first, size_t last) const
+    {
+      std::vector<size_t> values;
+      for (size_t size = first; size <= last; size *= _options.quick ? 16 : 4)
+        values.push_back(size);
+      return values;
+    }
+
+    static size_t drain(data_source* source, byte* dest, size_t callSize)
+    {
+      size_t total = 0, effective;
+      while ((effective = source->read(dest, callSize)) != END_OF_STREAM)
+        total += effective;
+      return total;
+    }
+
+    static size_t feed(data_sink* sink, const byte* src, size_t length, size_t callSize)
+    {
+      size_t done = 0;
+      while (done < length)
+      {
+        size_t effective = sink->write(src + done, std::min(callSize, length - done));
+        if (effective == END_OF_STREAM)
+          break;
+        done += effective;
+      }
+
+      sink->write(nullptr, END_OF_STREAM);
+      return done;
+    }
+
+    void memoryBuffer()
+    {
+      memory_buffer buffer(_options.size);
+
+      for (size_t call : sizes(64, MB1))
+      {
+        measure({ "memory_buffer", "write", WARM, _options.size, call, 0 }, [&] () {
+          buffer.rewind();
+          buffer.consume(buffer.used());
+          size_t total = 0;
+          while (total < _options.size)
+            total += buffer.write(_data.raw() + total, std::min(call, _options.size - total));
+          return total;
+        });
+
+        measure({ "memory_buffer", "read", WARM, _options.size, call, 0 }, [&] () {
+          std::vector<byte> dest(call);
+          _data.rewind();
+          return drain(&_data, dest.data(), call);
+        });
+      }
+
+      /* fifo usage as in filters, fill a bounded buffer and consume from its head */
+      for (size_t capacity : sizes(KB4, MB4))
+      {
+        for (size_t call : { capacity / 4, capacity })
+        {
+          measure({ "memory_buffer", "write_consume", WARM, capacity, call, 0 }, [&] () {
+            memory_buffer fifo(capacity);
+            size_t total = 0;
+            while (total < _options.size)
+            {
+              size_t effective = std::min({ call, fifo.available(), _options.size - total });
+              memcpy(fifo.tail(), _data.raw() + total, effective);
+              fifo.advance(effective);
+              fifo.consume(std::min(call / 2 + 1, fifo.used()));
+              total += effective;
+            }
+            return total;
+          });
+        }
+      }
+    }
+
+    void pipes()
+    {
+      for (size_t bufferSize : sizes(KB4, MB4))
+      {
+        measure({ "passthrough_pipe", "memory_to_null", WARM, bufferSize, bufferSize, 0 }, [&] () {
+          memory_buffer source(_data.raw(), _options.size, false);
+          null_data_sink sink;
+          passthrough_pipe pipe(&source, &sink, bufferSize);
+          pipe.process();
+          return size_t(source.tell());
+        });
+
+        for (const char* cache : { COLD, WARM })
+        {
+          measure({ "passthrough_pipe", "file_to_null", cache, bufferSize, bufferSize, 0 }, [&] () {
+            file_data_source source(_source);
+            null_data_sink sink;
+            passthrough_pipe pipe(&source, &sink, bufferSize);
+            pipe.process();
+            return size_t(source.tell());
+          });
+        }
+      }
+
+      /* file to file goes through the kernel, buffer size is only a fallback */
+      for (const char* cache : { COLD, WARM })
+      {
+        measure({ "passthrough_pipe", "file_to_file", cache, KB64, KB64, 0 }, [&] () {
+          file_data_source source(_source);
+          {
+            file_data_sink sink(_destination);
+            passthrough_pipe pipe(&source, &sink, KB64);
+            pipe.process();
+          }
+          return size_t(source.tell());
+        });
+      }
+    }
+
+    void filters()
+    {
+      std::vector<byte> dest(MB1);
+
+      for (size_t depth : { 1, 2, 4, 8 })
+      {
+        for (size_t bufferSize : sizes(KB4, MB1))
+        {
+          measure({ "source_filter", "copy_chain", WARM, bufferSize, KB64, depth }, [&] () {
+            memory_buffer source(_data.raw(), _options.size, false);
+            std::vector<std::unique_ptr<data_source>> chain;
+
+            data_source* last = &source;
+            for (size_t i = 0; i < depth; ++i)
+            {
+              chain.emplace_back(new source_filter<copy_filter>(last, bufferSize));
+              last = chain.back().get();
+            }
+
+            return drain(last, dest.data(), KB64);
+          });
+
+          measure({ "sink_filter", "copy_chain", WARM, bufferSize, KB64, depth }, [&] () {
+            null_data_sink sink;
+            std::vector<std::unique_ptr<data_sink>> chain;
+
+            data_sink* first = &sink;
+            for (size_t i = 0; i < depth; ++i)
+            {
+              chain.emplace_back(new sink_filter<copy_filter>(first, bufferSize));
+              first = chain.back().get();
+            }
+
+            return feed(first, _data.raw(), _options.size, KB64);
+          });
+        }
+      }
+
+      /* same chains composed at compile time, stages use the default buffer size */
+      fused<copy_filter>(dest.data());
+      fused<copy_filter, copy_filter>(dest.data());
+      fused<copy_filter, copy_filter, copy_filter, copy_filter>(dest.data());
+      fused<copy_filter, copy_filter, copy_filter, copy_filter, copy_filter, copy_filter, copy_filter, copy_filter>(dest.data());
+    }
+
+    template<typename... Fs> void fused(byte* dest)
+    {
+      measure({ "filter_chain", "copy_source", WARM, KB16, KB64, sizeof...(Fs) }, [&] () {
+        memory_buffer source(_data.raw(), _options.size, false);
+        chain_source<Fs...> chain(&source);
+        return drain(&chain, dest, KB64);
+      });
+
+      measure({ "filter_chain", "copy_sink", WARM, KB16, KB64, sizeof...(Fs) }, [&] () {
+        null_data_sink sink;
+        chain_sink<Fs...> chain(&sink);
+        return feed(&chain, _data.raw(), _options.size, KB64);
+      });
+    }
+
+    void files()
+    {
+      std::vector<byte> dest(MB4);
+
+      for (const char* cache : { COLD, WARM })
+      {
+        for (size_t call : sizes(KB4, MB4))
+        {
+          measure({ "file_data_source", "read", cache, 0, call, 0 }, [&] () {
+            file_data_source source(_source);
+            return drain(&source, dest.data(), call);
+          });
+        }
+
+        /* cache holds a fixed amount of data whatever the page size */
+        for (size_t pageSize : sizes(KB4, MB1))
+        {
+          for (size_t call : { KB4, KB64 })
+          {
+            measure({ "paged_file_data_source", "read", cache, pageSize, call, 0 }, [&] () {
+              paged_file_data_source source(_source, pageSize, std::max(size_t(16), MB64 / pageSize));
+              return drain(&source, dest.data(), call);
+            });
+          }
+        }
+      }
+
+      for (size_t call : sizes(KB4, MB4))
+      {
+        measure({ "file_data_sink", "write", WARM, 0, call, 0 }, [&] () {
+          file_data_sink sink(_destination);
+          return feed(&sink, _data.raw(), _options.size, call);
+        });
+
+        measure({ "mmap_data_sink", "write", WARM, MB64, call, 0 }, [&] () {
+          mmap_data_sink sink(_destination, _options.size);
+          return feed(&sink, _data.raw(), _options.size, call);
+        });
+      }
+    }
+
+    std::string toJson() const
+    {
+      std::string json = fmt::sprintf("{\"size\":%lu,\"repeat\":%lu,\"results\":[", _options.size, _options.repeat);
+
+      for (size_t i = 0; i < _results.size(); ++i)
+      {
+        const result& r = _results[i];
+        json += fmt::sprintf("%s{\"group\":\"%s\",\"name\":\"%s\",\"cache\":\"%s\",\"bufferSize\":%lu,\"callSize\":%lu,\"depth\":%lu,"
+                             "\"bytes\":%lu,\"seconds\":%.6f,\"gbps\":%.4f,\"syscalls\":%lu,\"syscallsPerMB\":%.3f}",
+                             i ? "," : "", r.group, r.name, r.cache, r.bufferSize, r.callSize, r.depth,
+                             r.bytes, r.seconds, r.throughput(), r.syscalls, r.syscallsPerMB());
+      }
+
+      return json + "]}\n";
+    }
+
+    void run()
+    {
+      prepare();
+
+      memoryBuffer();
+      pipes();
+      filters();
+      files();
+
+      file_handle handle(_options.output, file_mode::WRITING);
+      std::string json = toJson();
+
+      if (!handle || handle.write(json.data(), 1, json.length()) != json.length())
+        throw exceptions::messaged_exception(fmt::sprintf("streams_benchmark: unable to write %s", _options.output));
+    }
+  };
+}
+
+int main(int argc, const char* argv[])
+{
+  bench::options options;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+
+    if (arg == "--quick")
+    {
+      options.quick = true;
+      options.size = MB32;
+      options.repeat = 1;
+    }
+    else if (arg == "--size" && hasValue)
+      options.size = std::max(1UL, strtoul(argv[++i], nullptr, 10)) * MB1;
+    else if (arg == "--repeat" && hasValue)
+      options.repeat = std::max(1UL, strtoul(argv[++i], nullptr, 10));
+    else if (arg == "--dir" && hasValue)
+      options.folder = argv[++i];
+    else if (arg == "--output" && hasValue)
+      options.output = argv[++i];
+    else
+    {
+      fprintf(stderr, "usage: %s [--quick] [--size MB] [--repeat N] [--dir folder] [--output file.json]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  try
+  {
+    bench::runner(options).run();
+  }
+  catch (const std::exception& e)
+  {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
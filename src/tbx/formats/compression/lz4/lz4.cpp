@@ -0,0 +1,325 @@
+#include "lz4.h"
+
+#include "tbx/base/exceptions.h"
+
+#include <cstring>
+
+namespace lz4
+{
+  static constexpr size_t MIN_MATCH = 4;
+  static constexpr size_t LAST_LITERALS = 5;
+  static constexpr size_t MF_LIMIT = 12;
+  static constexpr size_t RUN_MASK = 15;
+  static constexpr size_t ML_MASK = 15;
+  static constexpr size_t WILD_COPY = 8;
+
+  static constexpr u32 HASH_LOG = 12;
+  static constexpr u32 SKIP_TRIGGER = 6;
+
+  static inline u32 read32(const byte* p) { u32 v; memcpy(&v, p, sizeof(v)); return v; }
+  static inline u64 read64(const byte* p) { u64 v; memcpy(&v, p, sizeof(v)); return v; }
+  static inline void write16le(byte* p, u16 v) { p[0] = v & 0xFF; p[1] = v >> 8; }
+  static inline u16 read16le(const byte* p) { return p[0] | (p[1] << 8); }
+
+  /* positions up to 4GB, hashes the 5 bytes at p which spreads better than 4 bytes on repetitive data */
+  struct wide_table
+  {
+    using entry = u32;
+    static constexpr u32 LOG = HASH_LOG;
+
+    static inline u32 hash(const byte* p)
+    {
+#if defined(IS_LITTLE_ENDIAN)
+      return static_cast<u32>(((read64(p) << 24) * 889523592379ULL) >> (64 - LOG));
+#else
+      return static_cast<u32>(((read64(p) >> 24) * 11400714785074694791ULL) >> (64 - LOG));
+#endif
+    }
+  };
+
+  /* inputs below SMALL_LIMIT index positions with 16 bits, twice the entries in the same space */
+  struct small_table
+  {
+    using entry = u16;
+    static constexpr u32 LOG = HASH_LOG + 1;
+
+    static inline u32 hash(const byte* p) { return (read32(p) * 2654435761U) >> (32 - LOG); }
+  };
+
+  static constexpr size_t SMALL_LIMIT = KB64 + MF_LIMIT - 1;
+
+  /* copies in 8 bytes steps, may write up to 7 bytes past dest + length */
+  static inline void wildCopy(byte* dest, const byte* src, size_t length)
+  {
+    byte* end = dest + length;
+    do
+    {
+      memcpy(dest, src, WILD_COPY);
+      dest += WILD_COPY;
+      src += WILD_COPY;
+    } while (dest < end);
+  }
+
+  static inline size_t count(const byte* ip, const byte* match, const byte* limit)
+  {
+    const byte* start = ip;
+
+    while (ip + sizeof(u64) <= limit)
+    {
+      u64 diff = read64(ip) ^ read64(match);
+      if (diff)
+      {
+#if defined(IS_LITTLE_ENDIAN)
+        return (ip - start) + (__builtin_ctzll(diff) >> 3);
+#else
+        return (ip - start) + (__builtin_clzll(diff) >> 3);
+#endif
+      }
+
+      ip += sizeof(u64);
+      match += sizeof(u64);
+    }
+
+    while (ip < limit && *ip == *match)
+    {
+      ++ip;
+      ++match;
+    }
+
+    return ip - start;
+  }
+
+  static inline byte* writeLength(byte* op, size_t length)
+  {
+    while (length >= 255)
+    {
+      *op++ = 255;
+      length -= 255;
+    }
+
+    *op++ = static_cast<byte>(length);
+    return op;
+  }
+
+  template<typename T>
+  static size_t compress(const byte* src, size_t length, byte* dest, int acceleration)
+  {
+    using entry = typename T::entry;
+    entry table[1 << T::LOG] = { 0 };
+
+    const byte* ip = src;
+    const byte* anchor = src;
+    const byte* const end = src + length;
+    const byte* const mfLimit = end - MF_LIMIT;
+    const byte* const matchLimit = end - LAST_LITERALS;
+
+    byte* op = dest;
+
+    if (acceleration < 1)
+      acceleration = 1;
+
+    if (length >= MF_LIMIT + 1)
+    {
+      table[T::hash(ip)] = 0;
+      ++ip;
+
+      for (;;)
+      {
+        const byte* match;
+        const byte* forward = ip;
+        u32 attempts = acceleration << SKIP_TRIGGER;
+
+        /* single probe hash table, step grows while no match is found */
+        do
+        {
+          ip = forward;
+          forward += attempts++ >> SKIP_TRIGGER;
+
+          /* ip itself may still be at mfLimit */
+          if (forward > mfLimit + 1)
+            goto last_literals;
+
+          u32 h = T::hash(ip);
+          match = src + table[h];
+          table[h] = static_cast<entry>(ip - src);
+        } while (size_t(ip - match) > MAX_DISTANCE || read32(match) != read32(ip));
+
+        /* extend backwards */
+        while (ip > anchor && match > src && ip[-1] == match[-1])
+        {
+          --ip;
+          --match;
+        }
+
+        {
+          size_t literals = ip - anchor;
+          byte* token = op++;
+
+          if (literals >= RUN_MASK)
+          {
+            *token = RUN_MASK << 4;
+            op = writeLength(op, literals - RUN_MASK);
+          }
+          else
+            *token = static_cast<byte>(literals << 4);
+
+          memcpy(op, anchor, literals);
+          op += literals;
+
+          for (;;)
+          {
+            write16le(op, static_cast<u16>(ip - match));
+            op += 2;
+
+            size_t matchLength = count(ip + MIN_MATCH, match + MIN_MATCH, matchLimit);
+            ip += matchLength + MIN_MATCH;
+
+            if (matchLength >= ML_MASK)
+            {
+              *token += ML_MASK;
+              op = writeLength(op, matchLength - ML_MASK);
+            }
+            else
+              *token += static_cast<byte>(matchLength);
+
+            anchor = ip;
+
+            if (ip > mfLimit)
+              goto last_literals;
+
+            table[T::hash(ip - 2)] = static_cast<entry>(ip - 2 - src);
+
+            /* try an immediate match at the current position */
+            u32 h = T::hash(ip);
+            match = src + table[h];
+            table[h] = static_cast<entry>(ip - src);
+
+            if (size_t(ip - match) <= MAX_DISTANCE && read32(match) == read32(ip))
+            {
+              token = op++;
+              *token = 0;
+            }
+            else
+              break;
+          }
+        }
+
+        ++ip;
+      }
+    }
+
+  last_literals:
+    size_t literals = end - anchor;
+
+    if (literals >= RUN_MASK)
+    {
+      *op++ = RUN_MASK << 4;
+      op = writeLength(op, literals - RUN_MASK);
+    }
+    else
+      *op++ = static_cast<byte>(literals << 4);
+
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - dest;
+  }
+
+  size_t compress(const byte* src, size_t length, byte* dest, int acceleration)
+  {
+    if (length < SMALL_LIMIT)
+      return compress<small_table>(src, length, dest, acceleration);
+    else
+      return compress<wide_table>(src, length, dest, acceleration);
+  }
+
+  [[noreturn]] static void malformed() { throw exceptions::file_format_error("lz4: malformed block"); }
+
+  static inline size_t readLength(const byte*& ip, const byte* end)
+  {
+    size_t length = 0;
+    byte s;
+
+    do
+    {
+      if (ip >= end)
+        malformed();
+      s = *ip++;
+      length += s;
+    } while (s == 255);
+
+    return length;
+  }
+
+  size_t decompress(const byte* src, size_t length, byte* dest, size_t capacity, size_t historyLength)
+  {
+    const byte* ip = src;
+    const byte* const end = src + length;
+
+    byte* op = dest;
+    byte* const outEnd = dest + capacity;
+    const byte* const lowest = dest - historyLength;
+
+    if (length == 0)
+      malformed();
+
+    for (;;)
+    {
+      const byte token = *ip++;
+
+      size_t literals = token >> 4;
+      if (literals == RUN_MASK)
+        literals += readLength(ip, end);
+
+      if (literals > size_t(end - ip) || literals > size_t(outEnd - op))
+        malformed();
+
+      if (op + literals + WILD_COPY <= outEnd && ip + literals + WILD_COPY <= end)
+        wildCopy(op, ip, literals);
+      else
+        memcpy(op, ip, literals);
+
+      op += literals;
+      ip += literals;
+
+      /* last sequence has no match part */
+      if (ip == end)
+        break;
+
+      if (end - ip < 2)
+        malformed();
+
+      const size_t offset = read16le(ip);
+      ip += 2;
+
+      if (offset == 0 || offset > size_t(op - lowest))
+        malformed();
+
+      const byte* match = op - offset;
+
+      size_t matchLength = token & ML_MASK;
+      if (matchLength == ML_MASK)
+        matchLength += readLength(ip, end);
+      matchLength += MIN_MATCH;
+
+      if (matchLength > size_t(outEnd - op))
+        malformed();
+
+      if (offset >= WILD_COPY && op + matchLength + WILD_COPY <= outEnd)
+        wildCopy(op, match, matchLength);
+      else
+      {
+        /* overlapping match, byte by byte repeats the pattern */
+        for (size_t i = 0; i < matchLength; ++i)
+          op[i] = match[i];
+      }
+
+      op += matchLength;
+
+      if (ip >= end)
+        malformed();
+    }
+
+    return op - dest;
+  }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "tbx/base/common.h"
+
+/* LZ4 block format codec, output is valid LZ4 readable by any conforming decoder but isn't
+   guaranteed to be byte identical to what the reference implementation produces */
+namespace lz4
+{
+  static constexpr size_t MAX_DISTANCE = 65535;
+  static constexpr size_t HISTORY_SIZE = KB64;
+
+  /* frame format */
+  static constexpr u32 FRAME_MAGIC = 0x184D2204;
+  static constexpr u32 SKIPPABLE_MAGIC_MASK = 0xFFFFFFF0;
+  static constexpr u32 SKIPPABLE_MAGIC = 0x184D2A50;
+  static constexpr u32 UNCOMPRESSED_BLOCK_FLAG = 0x80000000;
+  static constexpr size_t MAX_HEADER_SIZE = 4 + 2 + 8 + 4 + 1;
+
+  enum class block_size : u8
+  {
+    KB64 = 4,
+    KB256 = 5,
+    MB1 = 6,
+    MB4 = 7
+  };
+
+  inline size_t blockSizeInBytes(block_size size) { return size_t(1) << (8 + 2*static_cast<u8>(size)); }
+
+  inline size_t compressBound(size_t length) { return length + length/255 + 16; }
+
+  /* compresses src as a single independent block, dest must hold at least compressBound(length) bytes,
+     higher acceleration trades ratio for speed */
+  size_t compress(const byte* src, size_t length, byte* dest, int acceleration = 1);
+
+  /* decompresses a block into dest, matches may refer up to historyLength bytes before dest,
+     returns decompressed size, throws on malformed input or if output doesn't fit capacity */
+  size_t decompress(const byte* src, size_t length, byte* dest, size_t capacity, size_t historyLength = 0);
+}
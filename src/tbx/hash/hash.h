@@ -32,6 +32,32 @@ namespace hash
     static crc32_t compute(const class path& path);
   };
 
+  /* xxHash32, used by LZ4 frames */
+  using xxh32_t = u32;
+  
+  struct xxh32_digester
+  {
+  private:
+    static constexpr size_t STRIPE = 16;
+    
+    u32 seed;
+    u32 v[4];
+    u64 length;
+    byte buffer[STRIPE];
+    size_t buffered;
+    
+  public:
+    using computed_type = xxh32_t;
+    
+    xxh32_digester(u32 seed = 0) : seed(seed) { reset(); }
+    void update(const void* data, size_t length);
+    xxh32_t get() const;
+    
+    void reset();
+    
+    static xxh32_t compute(const void* data, size_t length, u32 seed = 0);
+  };
+
   /* MD5 */
   using md5_t = wrapped_array<16>;
   
@@ -0,0 +1,119 @@
+#include "hash.h"
+
+#include <cstring>
+
+namespace hash
+{
+  static constexpr u32 PRIME1 = 2654435761U;
+  static constexpr u32 PRIME2 = 2246822519U;
+  static constexpr u32 PRIME3 = 3266489917U;
+  static constexpr u32 PRIME4 = 668265263U;
+  static constexpr u32 PRIME5 = 374761393U;
+  
+  static inline u32 rotl(u32 x, u32 r) { return (x << r) | (x >> (32 - r)); }
+  
+  static inline u32 read32(const byte* p)
+  {
+    return u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);
+  }
+  
+  static inline u32 round(u32 acc, u32 input)
+  {
+    acc += input * PRIME2;
+    acc = rotl(acc, 13);
+    return acc * PRIME1;
+  }
+  
+  void xxh32_digester::reset()
+  {
+    v[0] = seed + PRIME1 + PRIME2;
+    v[1] = seed + PRIME2;
+    v[2] = seed;
+    v[3] = seed - PRIME1;
+    length = 0;
+    buffered = 0;
+  }
+  
+  void xxh32_digester::update(const void* data, size_t amount)
+  {
+    const byte* p = reinterpret_cast<const byte*>(data);
+    const byte* end = p + amount;
+    
+    length += amount;
+    
+    /* complete a partially filled stripe first */
+    if (buffered)
+    {
+      size_t fill = std::min(STRIPE - buffered, amount);
+      memcpy(buffer + buffered, p, fill);
+      buffered += fill;
+      p += fill;
+      
+      if (buffered < STRIPE)
+        return;
+      
+      for (size_t i = 0; i < 4; ++i)
+        v[i] = round(v[i], read32(buffer + i*4));
+      buffered = 0;
+    }
+    
+    while (size_t(end - p) >= STRIPE)
+    {
+      v[0] = round(v[0], read32(p));
+      v[1] = round(v[1], read32(p + 4));
+      v[2] = round(v[2], read32(p + 8));
+      v[3] = round(v[3], read32(p + 12));
+      p += STRIPE;
+    }
+    
+    if (p < end)
+    {
+      memcpy(buffer, p, end - p);
+      buffered = end - p;
+    }
+  }
+  
+  xxh32_t xxh32_digester::get() const
+  {
+    u32 h;
+    
+    if (length >= STRIPE)
+      h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    else
+      h = seed + PRIME5;
+    
+    h += static_cast<u32>(length);
+    
+    const byte* p = buffer;
+    const byte* end = buffer + buffered;
+    
+    while (end - p >= 4)
+    {
+      h += read32(p) * PRIME3;
+      h = rotl(h, 17) * PRIME4;
+      p += 4;
+    }
+    
+    while (p < end)
+    {
+      h += (*p) * PRIME5;
+      h = rotl(h, 11) * PRIME1;
+      ++p;
+    }
+    
+    h ^= h >> 15;
+    h *= PRIME2;
+    h ^= h >> 13;
+    h *= PRIME3;
+    h ^= h >> 16;
+    
+    return h;
+  }
+  
+  xxh32_t xxh32_digester::compute(const void* data, size_t length, u32 seed)
+  {
+    xxh32_digester digester(seed);
+    digester.update(data, length);
+    return digester.get();
+  }
+}
@@ -0,0 +1,562 @@
+#pragma once
+
+#if __cplusplus < 202002L
+#error "async_stream.h requires C++20 coroutines"
+#elif !defined(__linux__)
+#error "async_stream.h requires epoll"
+#endif
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* awaitable counterparts of data_source and data_sink, operations are coroutines returning
+   async::task<size_t> with the same END_OF_STREAM semantics as their synchronous versions,
+   an event_loop multiplexes them on a few threads waiting for descriptors through epoll,
+   synchronous streams are adapted by running their blocking calls on a thread_pool */
+namespace async
+{
+  template<typename T> class task;
+
+  namespace hidden
+  {
+    struct promise_base
+    {
+      /* resumed once the task completes, the task runs until its first suspension point otherwise */
+      std::coroutine_handle<> continuation;
+      std::exception_ptr error;
+
+      struct final_awaiter
+      {
+        bool await_ready() noexcept { return false; }
+        template<typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+        {
+          std::coroutine_handle<> continuation = handle.promise().continuation;
+          return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept { }
+      };
+
+      std::suspend_always initial_suspend() noexcept { return { }; }
+      final_awaiter final_suspend() noexcept { return { }; }
+      void unhandled_exception() { error = std::current_exception(); }
+
+      void rethrow() { if (error) std::rethrow_exception(error); }
+    };
+
+    template<typename T>
+    struct promise : promise_base
+    {
+      std::optional<T> value;
+
+      task<T> get_return_object();
+      void return_value(T v) { value.emplace(std::move(v)); }
+      T result() { rethrow(); return std::move(*value); }
+    };
+
+    template<>
+    struct promise<void> : promise_base
+    {
+      task<void> get_return_object();
+      void return_void() { }
+      void result() { rethrow(); }
+    };
+
+    /* fire and forget coroutine, frame is destroyed on completion */
+    struct detached
+    {
+      struct promise_type
+      {
+        detached get_return_object() { return { }; }
+        std::suspend_never initial_suspend() noexcept { return { }; }
+        std::suspend_never final_suspend() noexcept { return { }; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+      };
+    };
+  }
+
+  /* lazily started coroutine, runs when awaited and resumes its awaiter through symmetric transfer */
+  template<typename T = void>
+  class task
+  {
+  public:
+    using promise_type = hidden::promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+  private:
+    handle_type _handle;
+
+  public:
+    explicit task(handle_type handle) : _handle(handle) { }
+    task(task&& other) noexcept : _handle(other._handle) { other._handle = nullptr; }
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task() { if (_handle) _handle.destroy(); }
+
+    task& operator=(task&& other) noexcept
+    {
+      if (this != &other)
+      {
+        if (_handle)
+          _handle.destroy();
+        _handle = other._handle;
+        other._handle = nullptr;
+      }
+      return *this;
+    }
+
+    bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+      _handle.promise().continuation = awaiter;
+      return _handle;
+    }
+
+    T await_resume() { return _handle.promise().result(); }
+  };
+
+  namespace hidden
+  {
+    template<typename T> task<T> promise<T>::get_return_object() { return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this)); }
+    inline task<void> promise<void>::get_return_object() { return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this)); }
+  }
+
+  /* runs coroutines resumed either explicitly through post() or by readiness of a descriptor,
+     every thread waits on the same epoll instance and drains the shared ready queue */
+  class event_loop
+  {
+  private:
+    /* registered as epoll data, a descriptor can be awaited by a single operation at a time */
+    struct waiter
+    {
+      std::coroutine_handle<> handle;
+    };
+
+    int _epoll;
+    int _wakeup;
+
+    std::mutex _mutex;
+    std::deque<std::coroutine_handle<>> _ready;
+    size_t _sleeping;
+    std::atomic<bool> _stopping;
+
+    std::vector<std::thread> _threads;
+
+    void signal()
+    {
+      const uint64_t value = 1;
+      ssize_t r = ::write(_wakeup, &value, sizeof(value));
+      (void)r;
+    }
+
+    void run()
+    {
+      epoll_event events[64];
+
+      while (!_stopping)
+      {
+        std::coroutine_handle<> next;
+
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          if (!_ready.empty())
+          {
+            next = _ready.front();
+            _ready.pop_front();
+          }
+          else
+            ++_sleeping;
+        }
+
+        if (next)
+        {
+          next.resume();
+          continue;
+        }
+
+        int count = epoll_wait(_epoll, events, 64, -1);
+
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          --_sleeping;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+          if (events[i].data.ptr == nullptr)
+          {
+            uint64_t value;
+            if (!_stopping)
+            {
+              ssize_t r = ::read(_wakeup, &value, sizeof(value));
+              (void)r;
+            }
+          }
+          else
+            static_cast<waiter*>(events[i].data.ptr)->handle.resume();
+        }
+      }
+    }
+
+    class readiness_awaiter
+    {
+    private:
+      event_loop& _loop;
+      int _fd;
+      u32 _events;
+      waiter _waiter;
+
+    public:
+      readiness_awaiter(event_loop& loop, int fd, u32 events) : _loop(loop), _fd(fd), _events(events), _waiter({ nullptr }) { }
+
+      bool await_ready() const noexcept { return false; }
+
+      bool await_suspend(std::coroutine_handle<> handle)
+      {
+        _waiter.handle = handle;
+
+        epoll_event event = { };
+        event.events = _events | EPOLLONESHOT;
+        event.data.ptr = &_waiter;
+
+        if (epoll_ctl(_loop._epoll, EPOLL_CTL_MOD, _fd, &event) == 0)
+          return true;
+        else if (errno == ENOENT && epoll_ctl(_loop._epoll, EPOLL_CTL_ADD, _fd, &event) == 0)
+          return true;
+        /* regular files can't be polled and are always ready */
+        else if (errno == EPERM)
+          return false;
+
+        throw exceptions::messaged_exception(fmt::sprintf("event_loop: unable to wait on descriptor %d (%s)", _fd, strerror(errno)));
+      }
+
+      void await_resume() const noexcept { }
+    };
+
+    struct schedule_awaiter
+    {
+      event_loop& loop;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> handle) { loop.post(handle); }
+      void await_resume() const noexcept { }
+    };
+
+  public:
+    event_loop(size_t threads = 1) : _sleeping(0), _stopping(false)
+    {
+      assert(threads > 0);
+
+      _epoll = epoll_create1(EPOLL_CLOEXEC);
+      _wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+      if (_epoll < 0 || _wakeup < 0)
+        throw exceptions::messaged_exception("event_loop: unable to create epoll instance");
+
+      epoll_event event = { };
+      event.events = EPOLLIN;
+      event.data.ptr = nullptr;
+      epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &event);
+
+      for (size_t i = 0; i < threads; ++i)
+        _threads.emplace_back([this] () { run(); });
+    }
+
+    event_loop(const event_loop&) = delete;
+    event_loop& operator=(const event_loop&) = delete;
+
+    /* coroutines still suspended are leaked, they're expected to have completed */
+    ~event_loop()
+    {
+      _stopping = true;
+      signal();
+
+      for (std::thread& thread : _threads)
+        thread.join();
+
+      ::close(_wakeup);
+      ::close(_epoll);
+    }
+
+    void post(std::coroutine_handle<> handle)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _ready.push_back(handle);
+
+      if (_sleeping)
+        signal();
+    }
+
+    /* resumes the awaiting coroutine on a thread of the loop */
+    schedule_awaiter schedule() { return { *this }; }
+
+    /* suspends until fd is readable or writable, the descriptor must be non blocking */
+    readiness_awaiter readable(int fd) { return readiness_awaiter(*this, fd, EPOLLIN | EPOLLRDHUP); }
+    readiness_awaiter writable(int fd) { return readiness_awaiter(*this, fd, EPOLLOUT); }
+
+    /* descriptors must be forgotten before being closed */
+    void forget(int fd) { epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr); }
+
+    size_t threads() const { return _threads.size(); }
+  };
+
+  /* runs f on pool and resumes the awaiting coroutine on loop with its result */
+  template<typename F>
+  class offload_awaiter
+  {
+  public:
+    using result_t = decltype(std::declval<F>()());
+
+  private:
+    event_loop& _loop;
+    thread_pool& _pool;
+    F _function;
+
+    std::optional<result_t> _result;
+    std::exception_ptr _error;
+
+  public:
+    offload_awaiter(event_loop& loop, thread_pool& pool, F function) : _loop(loop), _pool(pool), _function(std::move(function)) { }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      _pool.submit([this, handle] () {
+        try
+        {
+          _result.emplace(_function());
+        }
+        catch (...)
+        {
+          _error = std::current_exception();
+        }
+
+        _loop.post(handle);
+      });
+    }
+
+    result_t await_resume()
+    {
+      if (_error)
+        std::rethrow_exception(_error);
+      return std::move(*_result);
+    }
+  };
+
+  template<typename F>
+  offload_awaiter<F> offload(event_loop& loop, thread_pool& pool, F function) { return offload_awaiter<F>(loop, pool, std::move(function)); }
+
+  /* starts t on loop without waiting for it, t must not throw */
+  inline void spawn(event_loop& loop, task<void> t)
+  {
+    [] (event_loop& loop, task<void> t) -> hidden::detached {
+      co_await loop.schedule();
+      co_await std::move(t);
+    }(loop, std::move(t));
+  }
+
+  /* blocks the calling thread until t completes on loop, rethrows its exception */
+  template<typename T>
+  T sync_wait(event_loop& loop, task<T> t)
+  {
+    std::promise<T> result;
+    std::future<T> future = result.get_future();
+
+    [] (event_loop& loop, task<T> t, std::promise<T>& result) -> hidden::detached {
+      co_await loop.schedule();
+      try
+      {
+        if constexpr (std::is_void_v<T>)
+        {
+          co_await std::move(t);
+          result.set_value();
+        }
+        else
+          result.set_value(co_await std::move(t));
+      }
+      catch (...)
+      {
+        result.set_exception(std::current_exception());
+      }
+    }(loop, std::move(t), result);
+
+    return future.get();
+  }
+}
+
+struct async_data_source
+{
+  virtual ~async_data_source() { }
+  virtual async::task<size_t> read(byte* dest, size_t amount) = 0;
+};
+
+struct async_data_sink
+{
+  virtual ~async_data_sink() { }
+  virtual async::task<size_t> write(const byte* src, size_t amount) = 0;
+};
+
+/* wraps a synchronous source, every read blocks a thread of pool instead of one of loop */
+class async_source_adapter : public async_data_source
+{
+private:
+  data_source* _source;
+  async::event_loop& _loop;
+  thread_pool& _pool;
+
+public:
+  async_source_adapter(data_source* source, async::event_loop& loop, thread_pool& pool) : _source(source), _loop(loop), _pool(pool) { }
+
+  async::task<size_t> read(byte* dest, size_t amount) override
+  {
+    co_return co_await async::offload(_loop, _pool, [this, dest, amount] () { return _source->read(dest, amount); });
+  }
+};
+
+/* wraps a synchronous sink, every write blocks a thread of pool instead of one of loop */
+class async_sink_adapter : public async_data_sink
+{
+private:
+  data_sink* _sink;
+  async::event_loop& _loop;
+  thread_pool& _pool;
+
+public:
+  async_sink_adapter(data_sink* sink, async::event_loop& loop, thread_pool& pool) : _sink(sink), _loop(loop), _pool(pool) { }
+
+  async::task<size_t> write(const byte* src, size_t amount) override
+  {
+    co_return co_await async::offload(_loop, _pool, [this, src, amount] () { return _sink->write(src, amount); });
+  }
+};
+
+/* reads a pipe or socket switched to non blocking mode, waiting for data suspends the
+   coroutine without holding a thread, descriptor is not owned */
+class async_fd_source : public async_data_source
+{
+private:
+  int _fd;
+  async::event_loop& _loop;
+
+public:
+  async_fd_source(int fd, async::event_loop& loop) : _fd(fd), _loop(loop)
+  {
+    descriptor::setNonBlocking(_fd);
+  }
+
+  ~async_fd_source() { _loop.forget(_fd); }
+
+  async::task<size_t> read(byte* dest, size_t amount) override
+  {
+    for (;;)
+    {
+      ssize_t effective = ::read(_fd, dest, amount);
+
+      if (effective > 0)
+        co_return effective;
+      else if (effective == 0)
+        co_return amount ? END_OF_STREAM : 0;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        co_await _loop.readable(_fd);
+      else if (errno != EINTR)
+        throw exceptions::messaged_exception(fmt::sprintf("async_fd_source: read failed (%s)", strerror(errno)));
+    }
+  }
+};
+
+/* writes to a pipe or socket switched to non blocking mode, end of stream closes
+   the descriptor so that the reader is notified, descriptor is owned */
+class async_fd_sink : public async_data_sink
+{
+private:
+  int _fd;
+  async::event_loop& _loop;
+
+public:
+  async_fd_sink(int fd, async::event_loop& loop) : _fd(fd), _loop(loop)
+  {
+    descriptor::setNonBlocking(_fd);
+  }
+
+  ~async_fd_sink()
+  {
+    if (_fd >= 0)
+    {
+      _loop.forget(_fd);
+      ::close(_fd);
+    }
+  }
+
+  async::task<size_t> write(const byte* src, size_t amount) override
+  {
+    if (_fd < 0)
+      co_return END_OF_STREAM;
+    else if (amount == END_OF_STREAM)
+    {
+      _loop.forget(_fd);
+      ::close(_fd);
+      _fd = -1;
+      co_return END_OF_STREAM;
+    }
+
+    for (;;)
+    {
+      ssize_t effective = ::write(_fd, src, amount);
+
+      if (effective >= 0)
+        co_return effective;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        co_await _loop.writable(_fd);
+      else if (errno != EINTR)
+        throw exceptions::messaged_exception(fmt::sprintf("async_fd_sink: write failed (%s)", strerror(errno)));
+    }
+  }
+};
+
+namespace async
+{
+  /* awaitable counterpart of passthrough_pipe, returns bytes moved, sink is notified of end of stream */
+  inline task<u64> passthrough(async_data_source* source, async_data_sink* sink, size_t bufferSize = KB64)
+  {
+    std::vector<byte> buffer(bufferSize);
+    u64 total = 0;
+
+    for (;;)
+    {
+      size_t effective = co_await source->read(buffer.data(), buffer.size());
+
+      if (effective == END_OF_STREAM)
+        break;
+
+      size_t done = 0;
+      while (done < effective)
+      {
+        size_t written = co_await sink->write(buffer.data() + done, effective - done);
+
+        if (written == END_OF_STREAM)
+          throw exceptions::messaged_exception("async::passthrough: sink refused data");
+
+        done += written;
+      }
+
+      total += effective;
+    }
+
+    co_await sink->write(nullptr, END_OF_STREAM);
+    TRACE_P("async::passthrough() %lu", total);
+    co_return total;
+  }
+}
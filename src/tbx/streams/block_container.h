@@ -0,0 +1,554 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "tbx/formats/compression/lz4/lz4.h"
+#include "tbx/hash/hash.h"
+#include "data_source.h"
+
+#include <deque>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <zlib.h>
+#include <lzma.h>
+
+/* seekable container of independently compressed blocks, all values are little endian
+
+   header   u32 magic, u8 version, u8 codec, u16 reserved, u32 block size
+   blocks   u32 stored size (high bit set if stored uncompressed), u32 xxh32 of uncompressed data, payload
+   index    u64 frame offset, u32 stored size and flag, u32 uncompressed size, for every block
+   trailer  u64 index offset, u64 block count, u64 uncompressed length, u32 xxh32 of index, u32 index magic
+
+   every block but the last holds exactly block size bytes of uncompressed data, blocks which
+   don't shrink are stored as they are */
+namespace block_container
+{
+  enum class codec : u8
+  {
+    STORE = 0,
+    ZLIB = 1,
+    LZMA = 2,
+    LZ4 = 3
+  };
+
+  static constexpr u32 MAGIC = 0x43425854; /* TXBC */
+  static constexpr u32 INDEX_MAGIC = 0x49425854; /* TXBI */
+  static constexpr u8 VERSION = 1;
+  static constexpr u32 STORED_FLAG = 0x80000000;
+
+  static constexpr size_t HEADER_SIZE = 12;
+  static constexpr size_t FRAME_HEADER_SIZE = 8;
+  static constexpr size_t INDEX_ENTRY_SIZE = 16;
+  static constexpr size_t TRAILER_SIZE = 32;
+
+  /* codec specific default, zlib level, lzma preset, lz4 acceleration */
+  static constexpr int DEFAULT_LEVEL = -1;
+
+  inline const char* codecName(codec c)
+  {
+    switch (c)
+    {
+      case codec::STORE: return "store";
+      case codec::ZLIB: return "zlib";
+      case codec::LZMA: return "lzma";
+      case codec::LZ4: return "lz4";
+    }
+
+    return "unknown";
+  }
+
+  /* returns compressed size in dest, 0 if the codec failed or data didn't shrink */
+  inline size_t compress(codec c, int level, const byte* src, size_t length, std::vector<byte>& dest)
+  {
+    size_t size = 0;
+
+    switch (c)
+    {
+      case codec::STORE:
+        break;
+      case codec::ZLIB:
+      {
+        uLongf bound = compressBound(static_cast<uLong>(length));
+        dest.resize(bound);
+        if (compress2(dest.data(), &bound, src, static_cast<uLong>(length), level) == Z_OK)
+          size = bound;
+        break;
+      }
+      case codec::LZMA:
+      {
+        size_t position = 0;
+        dest.resize(lzma_stream_buffer_bound(length));
+        if (lzma_easy_buffer_encode(level < 0 ? LZMA_PRESET_DEFAULT : level, LZMA_CHECK_NONE, nullptr, src, length, dest.data(), &position, dest.size()) == LZMA_OK)
+          size = position;
+        break;
+      }
+      case codec::LZ4:
+        dest.resize(lz4::compressBound(length));
+        size = lz4::compress(src, length, dest.data(), level < 1 ? 1 : level);
+        break;
+    }
+
+    return size < length ? size : 0;
+  }
+
+  /* true if src decompresses to exactly length bytes */
+  inline bool decompress(codec c, const byte* src, size_t stored, byte* dest, size_t length)
+  {
+    switch (c)
+    {
+      case codec::STORE:
+        return false;
+      case codec::ZLIB:
+      {
+        uLongf size = static_cast<uLongf>(length);
+        return uncompress(dest, &size, src, static_cast<uLong>(stored)) == Z_OK && size == length;
+      }
+      case codec::LZMA:
+      {
+        u64 memlimit = UINT64_MAX;
+        size_t in = 0, out = 0;
+        return lzma_stream_buffer_decode(&memlimit, 0, nullptr, src, &in, stored, dest, &out, length) == LZMA_OK && out == length;
+      }
+      case codec::LZ4:
+        try
+        {
+          return lz4::decompress(src, stored, dest, length) == length;
+        }
+        catch (const exceptions::exception&)
+        {
+          return false;
+        }
+    }
+
+    return false;
+  }
+}
+
+/* writes a block container to sink, blocks are compressed concurrently on a thread pool and
+   emitted in order, at most maxInFlight blocks are buffered, index and trailer are written
+   on end of stream which is then forwarded to sink */
+class block_container_sink : public data_sink
+{
+private:
+  struct block_job
+  {
+    std::vector<byte> input;
+    std::vector<byte> output;
+    size_t compressed;
+    u32 check;
+    std::future<void> done;
+  };
+
+  data_sink* _sink;
+  block_container::codec _codec;
+  int _level;
+  size_t _blockSize;
+  size_t _maxInFlight;
+  std::unique_ptr<thread_pool> _pool;
+
+  std::deque<std::unique_ptr<block_job>> _jobs;
+  std::vector<byte> _current;
+  std::vector<byte> _index;
+
+  u64 _offset;
+  u64 _length;
+  u64 _blocks;
+  bool _closed;
+
+  void emit(const byte* data, size_t length)
+  {
+    size_t done = 0;
+    while (done < length)
+    {
+      size_t effective = _sink->write(data + done, length - done);
+
+      if (effective == END_OF_STREAM || effective == 0)
+        throw exceptions::messaged_exception("block_container_sink: sink refused data");
+
+      done += effective;
+    }
+
+    _offset += length;
+  }
+
+  void writeHeader()
+  {
+    byte header[block_container::HEADER_SIZE] = { 0 };
+    hidden::writeLE32(header, block_container::MAGIC);
+    header[4] = block_container::VERSION;
+    header[5] = static_cast<u8>(_codec);
+    hidden::writeLE32(header + 8, static_cast<u32>(_blockSize));
+    emit(header, sizeof(header));
+  }
+
+  void submit()
+  {
+    std::unique_ptr<block_job> job(new block_job());
+    job->input.swap(_current);
+    _current.reserve(_blockSize);
+
+    block_job* raw = job.get();
+    const block_container::codec codec = _codec;
+    const int level = _level;
+
+    job->done = _pool->submit([raw, codec, level] () {
+      raw->check = hash::xxh32_digester::compute(raw->input.data(), raw->input.size());
+      raw->compressed = block_container::compress(codec, level, raw->input.data(), raw->input.size(), raw->output);
+    });
+
+    _jobs.push_back(std::move(job));
+  }
+
+  /* writes completed blocks in order, waits for the oldest ones if too many are in flight */
+  void collect(bool all)
+  {
+    while (!_jobs.empty())
+    {
+      block_job& job = *_jobs.front();
+
+      if (!all && _jobs.size() < _maxInFlight && job.done.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        break;
+
+      job.done.get();
+
+      const bool stored = job.compressed == 0;
+      const u32 size = static_cast<u32>(stored ? job.input.size() : job.compressed);
+      const u32 flagged = size | (stored ? block_container::STORED_FLAG : 0);
+
+      byte entry[block_container::INDEX_ENTRY_SIZE];
+      hidden::writeLE64(entry, _offset);
+      hidden::writeLE32(entry + 8, flagged);
+      hidden::writeLE32(entry + 12, static_cast<u32>(job.input.size()));
+      _index.insert(_index.end(), entry, entry + sizeof(entry));
+
+      byte header[block_container::FRAME_HEADER_SIZE];
+      hidden::writeLE32(header, flagged);
+      hidden::writeLE32(header + 4, job.check);
+      emit(header, sizeof(header));
+      emit(stored ? job.input.data() : job.output.data(), size);
+
+      TRACE_P("%p: block_container_sink::collect() block %lu %lu -> %u", this, _blocks, job.input.size(), size);
+
+      _length += job.input.size();
+      ++_blocks;
+      _jobs.pop_front();
+    }
+  }
+
+  void finish()
+  {
+    if (!_current.empty())
+      submit();
+
+    collect(true);
+
+    const u64 indexOffset = _offset;
+    emit(_index.data(), _index.size());
+
+    byte trailer[block_container::TRAILER_SIZE];
+    hidden::writeLE64(trailer, indexOffset);
+    hidden::writeLE64(trailer + 8, _blocks);
+    hidden::writeLE64(trailer + 16, _length);
+    hidden::writeLE32(trailer + 24, hash::xxh32_digester::compute(_index.data(), _index.size()));
+    hidden::writeLE32(trailer + 28, block_container::INDEX_MAGIC);
+    emit(trailer, sizeof(trailer));
+
+    _sink->write(nullptr, END_OF_STREAM);
+  }
+
+public:
+  block_container_sink(data_sink* sink, block_container::codec codec = block_container::codec::LZ4, size_t blockSize = MB1,
+                       int level = block_container::DEFAULT_LEVEL, size_t threads = thread_pool::defaultConcurrency()) :
+  _sink(sink), _codec(codec), _level(level), _blockSize(blockSize), _maxInFlight(threads * 2), _pool(new thread_pool(threads)),
+  _offset(0), _length(0), _blocks(0), _closed(false)
+  {
+    assert(blockSize > 0 && blockSize < block_container::STORED_FLAG && threads > 0);
+    _current.reserve(_blockSize);
+  }
+
+  ~block_container_sink()
+  {
+    /* pending jobs reference their own data only but must complete before being destroyed */
+    _pool.reset();
+  }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (_closed)
+      return END_OF_STREAM;
+
+    if (_offset == 0)
+      writeHeader();
+
+    if (amount == END_OF_STREAM)
+    {
+      _closed = true;
+      finish();
+      return END_OF_STREAM;
+    }
+
+    size_t done = 0;
+    while (done < amount)
+    {
+      size_t effective = std::min(amount - done, _blockSize - _current.size());
+      _current.insert(_current.end(), src + done, src + done + effective);
+      done += effective;
+
+      if (_current.size() == _blockSize)
+      {
+        submit();
+        collect(false);
+      }
+    }
+
+    return amount;
+  }
+
+  u64 blockCount() const { return _blocks; }
+  u64 compressedSize() const { return _offset; }
+};
+
+/* random access reader of a block container, only blocks covering the requested ranges are
+   read and decompressed, the most recently used ones are kept in a cache, readAt() can be
+   called concurrently, accesses to source are serialized */
+class block_container_source : public seekable_data_source
+{
+public:
+  struct statistics
+  {
+    u64 hits;
+    u64 misses;
+  };
+
+private:
+  struct block_info
+  {
+    u64 offset;
+    u32 stored;
+    u32 size;
+    u64 uncompressedOffset;
+  };
+
+  using block_ptr = std::shared_ptr<const std::vector<byte>>;
+  using lru_list = std::list<std::pair<size_t, block_ptr>>;
+
+  seekable_data_source* _source;
+  std::mutex _sourceMutex;
+
+  block_container::codec _codec;
+  size_t _blockSize;
+  std::vector<block_info> _blocks;
+  u64 _length;
+  roff_t _position;
+
+  size_t _maxCachedBlocks;
+  std::mutex _cacheMutex;
+  lru_list _lru;
+  std::unordered_map<size_t, lru_list::iterator> _cache;
+  statistics _statistics;
+
+  [[noreturn]] static void error(const std::string& message) { throw exceptions::file_format_error(fmt::sprintf("block_container_source: %s", message)); }
+
+  void readFully(u64 offset, byte* dest, size_t length)
+  {
+    std::lock_guard<std::mutex> lock(_sourceMutex);
+
+    size_t done = 0;
+    while (done < length)
+    {
+      size_t effective = _source->readAt(offset + done, dest + done, length - done);
+      if (effective == END_OF_STREAM || effective == 0)
+        error("unexpected end of file");
+      done += effective;
+    }
+  }
+
+  void parse()
+  {
+    const u64 size = _source->size();
+
+    if (size < block_container::HEADER_SIZE + block_container::TRAILER_SIZE)
+      error("file is too small");
+
+    byte header[block_container::HEADER_SIZE];
+    readFully(0, header, sizeof(header));
+
+    if (hidden::readLE32(header) != block_container::MAGIC)
+      error("invalid magic number");
+    else if (header[4] != block_container::VERSION)
+      error(fmt::sprintf("unsupported version %u", header[4]));
+    else if (header[5] > static_cast<u8>(block_container::codec::LZ4))
+      error(fmt::sprintf("unknown codec %u", header[5]));
+
+    _codec = static_cast<block_container::codec>(header[5]);
+    _blockSize = hidden::readLE32(header + 8);
+
+    if (_blockSize == 0 || _blockSize >= block_container::STORED_FLAG)
+      error("invalid block size");
+
+    byte trailer[block_container::TRAILER_SIZE];
+    readFully(size - sizeof(trailer), trailer, sizeof(trailer));
+
+    if (hidden::readLE32(trailer + 28) != block_container::INDEX_MAGIC)
+      error("invalid trailer");
+
+    const u64 indexOffset = hidden::readLE64(trailer);
+    const u64 count = hidden::readLE64(trailer + 8);
+    _length = hidden::readLE64(trailer + 16);
+
+    if (indexOffset < block_container::HEADER_SIZE || count > (size - block_container::TRAILER_SIZE - indexOffset) / block_container::INDEX_ENTRY_SIZE ||
+        indexOffset + count * block_container::INDEX_ENTRY_SIZE + block_container::TRAILER_SIZE != size)
+      error("invalid index bounds");
+
+    std::vector<byte> index(count * block_container::INDEX_ENTRY_SIZE);
+    readFully(indexOffset, index.data(), index.size());
+
+    if (hash::xxh32_digester::compute(index.data(), index.size()) != hidden::readLE32(trailer + 24))
+      error("index checksum mismatch");
+
+    u64 uncompressed = 0;
+    _blocks.reserve(count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      const byte* entry = index.data() + i * block_container::INDEX_ENTRY_SIZE;
+      block_info info = { hidden::readLE64(entry), hidden::readLE32(entry + 8), hidden::readLE32(entry + 12), uncompressed };
+
+      const u64 stored = info.stored & ~block_container::STORED_FLAG;
+      if (info.offset < block_container::HEADER_SIZE || info.offset + block_container::FRAME_HEADER_SIZE + stored > indexOffset ||
+          info.size == 0 || info.size > _blockSize || (i + 1 < count && info.size != _blockSize))
+        error(fmt::sprintf("invalid index entry %lu", i));
+
+      uncompressed += info.size;
+      _blocks.push_back(info);
+    }
+
+    if (uncompressed != _length)
+      error("index doesn't match uncompressed length");
+  }
+
+  block_ptr decode(size_t index)
+  {
+    const block_info& info = _blocks[index];
+    const bool stored = (info.stored & block_container::STORED_FLAG) != 0;
+    const size_t size = info.stored & ~block_container::STORED_FLAG;
+
+    std::vector<byte> frame(block_container::FRAME_HEADER_SIZE + size);
+    readFully(info.offset, frame.data(), frame.size());
+
+    if (hidden::readLE32(frame.data()) != info.stored)
+      error(fmt::sprintf("block %lu header doesn't match index", index));
+
+    const u32 check = hidden::readLE32(frame.data() + 4);
+    std::shared_ptr<std::vector<byte>> output;
+    const byte* payload = frame.data() + block_container::FRAME_HEADER_SIZE;
+
+    if (stored)
+    {
+      if (size != info.size)
+        error(fmt::sprintf("block %lu size mismatch", index));
+
+      frame.erase(frame.begin(), frame.begin() + block_container::FRAME_HEADER_SIZE);
+      output = std::make_shared<std::vector<byte>>(std::move(frame));
+    }
+    else
+    {
+      output = std::make_shared<std::vector<byte>>(info.size);
+      if (!block_container::decompress(_codec, payload, size, output->data(), info.size))
+        error(fmt::sprintf("block %lu is corrupt", index));
+    }
+
+    if (hash::xxh32_digester::compute(output->data(), output->size()) != check)
+      error(fmt::sprintf("block %lu checksum mismatch", index));
+
+    TRACE_P("%p: block_container_source::decode(%lu) %lu -> %u", this, index, size, info.size);
+    return output;
+  }
+
+  block_ptr block(size_t index)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_cacheMutex);
+      auto it = _cache.find(index);
+
+      if (it != _cache.end())
+      {
+        _lru.splice(_lru.begin(), _lru, it->second);
+        ++_statistics.hits;
+        return it->second->second;
+      }
+
+      ++_statistics.misses;
+    }
+
+    /* decoded outside of the lock, concurrent misses on the same block decode it twice */
+    block_ptr data = decode(index);
+
+    std::lock_guard<std::mutex> lock(_cacheMutex);
+
+    if (_cache.find(index) == _cache.end())
+    {
+      _lru.emplace_front(index, data);
+      _cache[index] = _lru.begin();
+
+      if (_lru.size() > _maxCachedBlocks)
+      {
+        _cache.erase(_lru.back().first);
+        _lru.pop_back();
+      }
+    }
+
+    return data;
+  }
+
+  /* index guarantees every block but the last is exactly block size long */
+  size_t findBlock(u64 position) const { return position / _blockSize; }
+
+public:
+  block_container_source(seekable_data_source* source, size_t maxCachedBlocks = 8) :
+  _source(source), _length(0), _position(0), _maxCachedBlocks(std::max(size_t(1), maxCachedBlocks)), _statistics({ 0, 0 })
+  {
+    parse();
+  }
+
+  size_t readAt(roff_t offset, byte* dest, size_t amount) override
+  {
+    if (offset < 0 || u64(offset) >= _length)
+      return END_OF_STREAM;
+
+    const size_t index = findBlock(offset);
+    block_ptr data = block(index);
+
+    const size_t positionInBlock = offset - _blocks[index].uncompressedOffset;
+    const size_t effective = std::min(amount, data->size() - positionInBlock);
+
+    memcpy(dest, data->data() + positionInBlock, effective);
+    return effective;
+  }
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    size_t effective = readAt(_position, dest, amount);
+
+    if (effective != END_OF_STREAM)
+      _position += effective;
+
+    return effective;
+  }
+
+  void seek(roff_t position) override { _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _length; }
+
+  block_container::codec codec() const { return _codec; }
+  size_t blockCount() const { return _blocks.size(); }
+
+  statistics stats()
+  {
+    std::lock_guard<std::mutex> lock(_cacheMutex);
+    return _statistics;
+  }
+};
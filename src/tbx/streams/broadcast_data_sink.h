@@ -0,0 +1,168 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+#include "memory_buffer.h"
+
+#include <exception>
+
+/* sink which forwards the same stream to multiple sinks, each one driven by its own worker,
+   written data is gathered in blocks which are shared by every sink without copying, each
+   sink has a bounded queue of pending blocks so writing stalls once the slowest sink
+   falls queueDepth blocks behind, end of stream waits for every sink to be done and
+   rethrows the first failure, a sink refusing data before end of stream is a failure */
+class broadcast_data_sink : public data_sink
+{
+private:
+  using block_ptr = std::shared_ptr<const memory_buffer>;
+  using block_queue = bounded_queue<block_ptr>;
+
+  std::vector<data_sink*> _sinks;
+  std::vector<std::unique_ptr<block_queue>> _queues;
+  std::unique_ptr<thread_pool> _pool;
+
+  size_t _blockSize;
+  size_t _queueDepth;
+
+  std::unique_ptr<memory_buffer> _current;
+  bool _closed;
+
+  std::mutex _errorMutex;
+  std::exception_ptr _error;
+
+  void fail()
+  {
+    std::lock_guard<std::mutex> lock(_errorMutex);
+    if (!_error)
+      _error = std::current_exception();
+  }
+
+  void checkError()
+  {
+    std::lock_guard<std::mutex> lock(_errorMutex);
+    if (_error)
+      std::rethrow_exception(_error);
+  }
+
+  void runSink(data_sink* sink, block_queue& queue)
+  {
+    block_ptr block;
+
+    try
+    {
+      while (queue.pop(block))
+      {
+        size_t done = 0;
+        while (done < block->used())
+        {
+          size_t effective = sink->write(block->data() + done, block->used() - done);
+
+          if (effective == END_OF_STREAM)
+            throw exceptions::messaged_exception("broadcast_data_sink: sink closed before end of stream");
+
+          done += effective;
+        }
+
+        block.reset();
+      }
+
+      sink->write(nullptr, END_OF_STREAM);
+    }
+    catch (...)
+    {
+      fail();
+
+      /* keep consuming so that the writer never blocks on a dead sink */
+      while (queue.pop(block))
+        block.reset();
+    }
+  }
+
+  void start()
+  {
+    for (size_t i = 0; i < _sinks.size(); ++i)
+      _queues.emplace_back(new block_queue(_queueDepth));
+
+    _pool.reset(new thread_pool(_sinks.size()));
+
+    for (size_t i = 0; i < _sinks.size(); ++i)
+      _pool->submit([this, i] () { runSink(_sinks[i], *_queues[i]); });
+  }
+
+  void publish()
+  {
+    if (!_current || _current->empty())
+      return;
+
+    block_ptr block(_current.release());
+
+    for (auto& queue : _queues)
+      queue->push(block_ptr(block));
+  }
+
+  void close()
+  {
+    if (_closed)
+      return;
+
+    _closed = true;
+
+    for (auto& queue : _queues)
+      queue->close();
+
+    _pool.reset();
+  }
+
+public:
+  broadcast_data_sink(const std::vector<data_sink*>& sinks, size_t blockSize = KB64, size_t queueDepth = 4) :
+  _sinks(sinks), _blockSize(blockSize), _queueDepth(queueDepth), _closed(false)
+  {
+    assert(!sinks.empty() && blockSize > 0 && queueDepth > 0);
+  }
+
+  broadcast_data_sink(const broadcast_data_sink&) = delete;
+  broadcast_data_sink& operator=(const broadcast_data_sink&) = delete;
+
+  ~broadcast_data_sink() { close(); }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (_closed)
+      return END_OF_STREAM;
+
+    if (!_pool)
+      start();
+
+    if (amount == END_OF_STREAM)
+    {
+      publish();
+      close();
+      TRACE_P("%p: broadcast_data_sink::write() EOS -> closed", this);
+
+      checkError();
+      return END_OF_STREAM;
+    }
+
+    checkError();
+
+    size_t done = 0;
+    while (done < amount)
+    {
+      if (!_current)
+        _current.reset(new memory_buffer(_blockSize));
+
+      size_t effective = std::min(amount - done, _current->available());
+      memcpy(_current->tail(), src + done, effective);
+      _current->advance(effective);
+      done += effective;
+
+      if (_current->full())
+        publish();
+    }
+
+    return amount;
+  }
+
+  size_t count() const { return _sinks.size(); }
+};
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "tbx/base/common.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+/* process wide allocator for stream buffers, sizes are rounded up to power of two classes
+   and released blocks are recycled instead of being returned to the system, each thread keeps
+   a few blocks per class to avoid locking, the rest is shared through per class free lists
+   up to a retain limit, every block is aligned to a cache line, blocks of at least a page
+   are aligned to a page so they can be used for direct I/O, content is undefined
+   when handed out, blocks above the largest class are allocated and freed directly, on Linux
+   they're anonymous mappings backed by huge pages when possible which grow in place with
+   mremap so large buffers can be extended without copying */
+class buffer_pool
+{
+public:
+  static constexpr size_t ALIGNMENT = 64;
+  static constexpr size_t PAGE_ALIGNMENT = KB4;
+  static constexpr size_t MIN_CLASS_SIZE = 256;
+  static constexpr size_t MAX_CLASS_SIZE = MB4;
+  static constexpr size_t CLASS_COUNT = 15;
+  static constexpr size_t THREAD_CACHE_BLOCKS = 4;
+  static constexpr size_t DEFAULT_RETAIN_LIMIT = MB64;
+
+  struct statistics
+  {
+    u64 allocations;
+    u64 hits;
+    u64 remaps;
+    size_t used;
+    size_t peak;
+    size_t retained;
+  };
+
+private:
+  static_assert(MIN_CLASS_SIZE << (CLASS_COUNT - 1) == MAX_CLASS_SIZE, "");
+
+  struct size_class
+  {
+    std::mutex mutex;
+    std::vector<byte*> blocks;
+  };
+
+  struct thread_cache
+  {
+    std::vector<byte*> blocks[CLASS_COUNT];
+
+    ~thread_cache()
+    {
+      for (size_t i = 0; i < CLASS_COUNT; ++i)
+        for (byte* block : blocks[i])
+          instance().reclaim(i, block);
+    }
+  };
+
+  size_class _classes[CLASS_COUNT];
+  std::atomic<size_t> _retainLimit;
+
+  std::atomic<u64> _allocations;
+  std::atomic<u64> _hits;
+  std::atomic<u64> _remaps;
+  std::atomic<size_t> _used;
+  std::atomic<size_t> _peak;
+  std::atomic<size_t> _retained;
+
+  buffer_pool() : _retainLimit(DEFAULT_RETAIN_LIMIT), _allocations(0), _hits(0), _remaps(0), _used(0), _peak(0), _retained(0) { }
+
+  static thread_cache& local()
+  {
+    static thread_local thread_cache cache;
+    return cache;
+  }
+
+  static size_t classFor(size_t size)
+  {
+    size_t index = 0;
+    for (size_t classSize = MIN_CLASS_SIZE; classSize < size; classSize <<= 1)
+      ++index;
+    return index;
+  }
+
+  static size_t classSize(size_t index) { return MIN_CLASS_SIZE << index; }
+
+  static byte* systemAllocate(size_t size)
+  {
+    const size_t alignment = size >= PAGE_ALIGNMENT ? PAGE_ALIGNMENT : ALIGNMENT;
+
+#if defined(_WIN32)
+    void* data = _aligned_malloc(size, alignment);
+#else
+    void* data = nullptr;
+    if (posix_memalign(&data, alignment, size) != 0)
+      data = nullptr;
+#endif
+
+    if (!data)
+      throw exceptions::not_enough_memory("buffer_pool");
+
+    return static_cast<byte*>(data);
+  }
+
+  static void systemFree(byte* data)
+  {
+#if defined(_WIN32)
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+  }
+
+#if defined(__linux__)
+  /* mappings are multiple of the huge page size so that the tail can be backed by one too */
+  static size_t mappedLength(size_t size) { return (size + MB2 - 1) & ~(MB2 - 1); }
+
+  static byte* largeAllocate(size_t size)
+  {
+    void* data = mmap(nullptr, mappedLength(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (data == MAP_FAILED)
+      throw exceptions::not_enough_memory("buffer_pool");
+
+#if defined(MADV_HUGEPAGE)
+    madvise(data, mappedLength(size), MADV_HUGEPAGE);
+#endif
+
+    return static_cast<byte*>(data);
+  }
+
+  static void largeFree(byte* data, size_t size) { munmap(data, mappedLength(size)); }
+#else
+  static byte* largeAllocate(size_t size) { return systemAllocate(size); }
+  static void largeFree(byte* data, size_t) { systemFree(data); }
+#endif
+
+  void account(size_t size)
+  {
+    size_t used = (_used += size);
+    size_t peak = _peak.load();
+
+    while (used > peak && !_peak.compare_exchange_weak(peak, used));
+  }
+
+  /* moves a block to the shared free list, or back to the system past the retain limit */
+  void reclaim(size_t index, byte* block)
+  {
+    const size_t size = classSize(index);
+
+    if (_retained + size <= _retainLimit)
+    {
+      std::lock_guard<std::mutex> lock(_classes[index].mutex);
+      _classes[index].blocks.push_back(block);
+      _retained += size;
+    }
+    else
+      systemFree(block);
+  }
+
+public:
+  static buffer_pool& instance()
+  {
+    static buffer_pool pool;
+    return pool;
+  }
+
+  buffer_pool(const buffer_pool&) = delete;
+  buffer_pool& operator=(const buffer_pool&) = delete;
+
+  ~buffer_pool() { trim(); }
+
+  byte* allocate(size_t size)
+  {
+    if (size == 0)
+      return nullptr;
+
+    ++_allocations;
+
+    if (size > MAX_CLASS_SIZE)
+    {
+      account(size);
+      return largeAllocate(size);
+    }
+
+    const size_t index = classFor(size);
+    account(classSize(index));
+
+    std::vector<byte*>& cached = local().blocks[index];
+    if (!cached.empty())
+    {
+      byte* block = cached.back();
+      cached.pop_back();
+      ++_hits;
+      return block;
+    }
+
+    {
+      size_class& shared = _classes[index];
+      std::lock_guard<std::mutex> lock(shared.mutex);
+
+      if (!shared.blocks.empty())
+      {
+        byte* block = shared.blocks.back();
+        shared.blocks.pop_back();
+        _retained -= classSize(index);
+        ++_hits;
+        return block;
+      }
+    }
+
+    return systemAllocate(classSize(index));
+  }
+
+  /* size must be the one requested when the block was allocated */
+  void release(byte* data, size_t size)
+  {
+    if (!data)
+      return;
+
+    if (size > MAX_CLASS_SIZE)
+    {
+      _used -= size;
+      largeFree(data, size);
+      return;
+    }
+
+    const size_t index = classFor(size);
+    _used -= classSize(index);
+
+    std::vector<byte*>& cached = local().blocks[index];
+    if (cached.size() < THREAD_CACHE_BLOCKS)
+      cached.push_back(data);
+    else
+      reclaim(index, data);
+  }
+
+  /* moves a block to a new size keeping its first used bytes, large blocks are remapped
+     in place on Linux, otherwise a new block is allocated and used bytes are copied */
+  byte* reallocate(byte* data, size_t size, size_t used, size_t newSize)
+  {
+#if defined(__linux__)
+    if (data && size > MAX_CLASS_SIZE && newSize > MAX_CLASS_SIZE)
+    {
+      void* remapped = mremap(data, mappedLength(size), mappedLength(newSize), MREMAP_MAYMOVE);
+
+      if (remapped == MAP_FAILED)
+        throw exceptions::not_enough_memory("buffer_pool");
+
+      _used -= size;
+      account(newSize);
+      ++_remaps;
+      return static_cast<byte*>(remapped);
+    }
+#endif
+
+    byte* block = allocate(newSize);
+    if (used)
+      memcpy(block, data, std::min(used, newSize));
+    release(data, size);
+    return block;
+  }
+
+  /* returns every shared free block to the system, blocks cached by threads are kept */
+  void trim()
+  {
+    for (size_t i = 0; i < CLASS_COUNT; ++i)
+    {
+      std::lock_guard<std::mutex> lock(_classes[i].mutex);
+
+      for (byte* block : _classes[i].blocks)
+        systemFree(block);
+
+      _retained -= _classes[i].blocks.size() * classSize(i);
+      _classes[i].blocks.clear();
+    }
+  }
+
+  void setRetainLimit(size_t limit) { _retainLimit = limit; }
+
+  statistics stats() const { return { _allocations.load(), _hits.load(), _remaps.load(), _used.load(), _peak.load(), _retained.load() }; }
+};
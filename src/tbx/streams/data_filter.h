@@ -272,9 +272,14 @@ public:
     else
     {
       _filter.markEnded();
+      /* output must be drained while finishing or filters producing more than a buffer would stall */
       while (!_filter.finished())
+      {
         _filter.process();
-        while (dumpOutput() != END_OF_STREAM) ;
+        if (!_filter.out().empty())
+          dumpOutput();
+      }
+      while (dumpOutput() != END_OF_STREAM) ;
       effective = END_OF_STREAM;
     }
     
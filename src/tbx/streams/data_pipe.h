@@ -3,15 +3,20 @@
 #include "tbx/base/common.h"
 #include "data_source.h"
 #include "memory_buffer.h"
+#include "file_data_source.h"
 
 class data_pipe
 {
   virtual void process() = 0;
 };
 
+/* when both ends are plain files data is copied by the kernel without passing through
+   the buffer, otherwise or if the kernel can't do it the buffered loop is used */
 class passthrough_pipe : public data_pipe
 {
 private:
+  static constexpr size_t DIRECT_CHUNK_SIZE = MB8;
+  
   enum class state
   {
     READY = 0,
@@ -28,9 +33,37 @@ private:
   
   state _state;
   
+  file_data_source* _directSource;
+  file_data_sink* _directSink;
+  
+  /* returns bytes moved by the kernel, disables the direct path when it's not available */
+  size_t stepDirect()
+  {
+    size_t remaining = _directSource->size() - _directSource->tell();
+    
+    if (remaining == 0)
+    {
+      _state = state::END_OF_INPUT;
+      TRACE_P("%p: pipe::stepDirect() state: OPEN -> END_OF_INPUT", this);
+      return 0;
+    }
+    
+    size_t effective = _directSource->handle().transfer(_directSink->handle(), std::min(remaining, DIRECT_CHUNK_SIZE));
+    TRACE_P("%p: pipe::stepDirect() %lu", this, effective);
+    
+    if (effective == 0)
+      _directSource = nullptr;
+    
+    return effective;
+  }
+  
 public:
-  passthrough_pipe(data_source* source, data_sink* sink, size_t bufferSize) : _source(source), _sink(sink), _buffer(bufferSize), _state(state::OPENED)
-  { }
+  passthrough_pipe(data_source* source, data_sink* sink, size_t bufferSize) : _source(source), _sink(sink), _buffer(bufferSize), _state(state::OPENED),
+  _directSource(dynamic_cast<file_data_source*>(source)), _directSink(dynamic_cast<file_data_sink*>(sink))
+  {
+    if (!_directSink)
+      _directSource = nullptr;
+  }
   
   void stepInput()
   {
@@ -91,12 +124,22 @@ public:
     }
   }
   
-  inline void step()
+  inline size_t step()
   {
+    if (_state == state::OPENED && _directSource && _buffer.empty())
+    {
+      size_t effective = stepDirect();
+      
+      if (effective || _state != state::OPENED)
+        return effective;
+    }
+    
     if (_state == state::OPENED)
       stepInput();
     
+    size_t availableOutput = _buffer.used();
     stepOutput();
+    return availableOutput - _buffer.used();
   }
   
   void process() override
@@ -113,14 +156,7 @@ public:
     
     while (_state != state::CLOSED)
     {
-      if (_state == state::OPENED)
-        stepInput();
-      
-      size_t availableOutput = _buffer.used();
-      
-      stepOutput();
-      
-      size += availableOutput - _buffer.used();
+      size += step();
       
       if (size >= requiredSize)
         break;
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+#include "data_filter.h"
+#include "data_pipe.h"
+
+#include <chrono>
+#include <exception>
+
+/* pipe which runs every data_filter stage on its own worker thread, stages are
+   connected by bounded queues of chunks so that a slow stage only stalls its neighbours
+   once their queues are full/empty, filters are driven with the same protocol used
+   by source_filter/sink_filter so any data_filter can be used unchanged */
+class data_pipeline : public data_pipe
+{
+public:
+  struct stage_stats
+  {
+    std::string name;
+    size_t bytesIn;
+    size_t bytesOut;
+    u64 busyNanos;
+    u64 waitNanos;
+
+    stage_stats(const std::string& name) : name(name), bytesIn(0), bytesOut(0), busyNanos(0), waitNanos(0) { }
+
+    /* fraction of wall time spent working instead of waiting on queues */
+    float utilization() const { return busyNanos + waitNanos ? busyNanos / float(busyNanos + waitNanos) : 0.0f; }
+  };
+
+private:
+  using clock = std::chrono::steady_clock;
+  using chunk_queue = bounded_queue<memory_buffer>;
+
+  data_source* _source;
+  data_sink* _sink;
+
+  std::vector<std::unique_ptr<data_filter>> _stages;
+  std::vector<stage_stats> _stats;
+
+  size_t _chunkSize;
+  size_t _queueDepth;
+
+  std::mutex _errorMutex;
+  std::exception_ptr _error;
+
+  static u64 elapsed(clock::time_point since) { return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - since).count(); }
+
+  void fail(std::vector<std::unique_ptr<chunk_queue>>& queues)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_errorMutex);
+      if (!_error)
+        _error = std::current_exception();
+    }
+
+    /* wake up every stage so that the whole pipeline unwinds */
+    for (auto& queue : queues)
+      queue->close();
+  }
+
+  void runSource(chunk_queue& output, stage_stats& stats)
+  {
+    for (;;)
+    {
+      auto mark = clock::now();
+      memory_buffer chunk(_chunkSize);
+      size_t effective = _source->read(chunk.tail(), chunk.available());
+      stats.busyNanos += elapsed(mark);
+
+      if (effective == END_OF_STREAM)
+        break;
+      else if (effective)
+      {
+        chunk.advance(effective);
+        stats.bytesOut += effective;
+
+        mark = clock::now();
+        bool accepted = output.push(std::move(chunk));
+        stats.waitNanos += elapsed(mark);
+
+        if (!accepted)
+          break;
+      }
+    }
+
+    output.close();
+  }
+
+  void flushOutput(data_filter* filter, chunk_queue& output, stage_stats& stats)
+  {
+    memory_buffer& out = filter->out();
+
+    if (!out.empty())
+    {
+      stats.bytesOut += out.used();
+
+      memory_buffer chunk(out.head(), out.used());
+      out.consume(out.used());
+
+      auto mark = clock::now();
+      output.push(std::move(chunk));
+      stats.waitNanos += elapsed(mark);
+    }
+  }
+
+  void runStage(data_filter* filter, chunk_queue& input, chunk_queue& output, stage_stats& stats)
+  {
+    memory_buffer chunk;
+    bool hasChunk = false;
+
+    auto mark = clock::now();
+
+    if (!filter->started())
+    {
+      filter->init();
+      filter->start();
+    }
+
+    while (!filter->finished())
+    {
+      if (!hasChunk && !filter->ended())
+      {
+        stats.busyNanos += elapsed(mark);
+        mark = clock::now();
+        hasChunk = input.pop(chunk);
+        stats.waitNanos += elapsed(mark);
+        mark = clock::now();
+
+        if (!hasChunk)
+          filter->markEnded();
+        else
+          chunk.rewind();
+      }
+
+      if (hasChunk)
+      {
+        memory_buffer& in = filter->in();
+        size_t effective = std::min(in.available(), chunk.toRead());
+        std::copy(chunk.direct(), chunk.direct() + effective, in.tail());
+        in.advance(effective);
+        chunk.seek(effective, Seek::CUR);
+        stats.bytesIn += effective;
+
+        if (chunk.eob())
+          hasChunk = false;
+      }
+
+      filter->process();
+
+      stats.busyNanos += elapsed(mark);
+      flushOutput(filter, output, stats);
+      mark = clock::now();
+
+      if (output.closed())
+        break;
+    }
+
+    /* additional buffered data is discarded as source_filter does */
+    filter->in().consume(filter->in().used());
+    flushOutput(filter, output, stats);
+    filter->finalize();
+    stats.busyNanos += elapsed(mark);
+
+    /* a filter may finish before its input ends, upstream must not block on us */
+    input.close();
+    output.close();
+  }
+
+  void runSink(chunk_queue& input, stage_stats& stats)
+  {
+    memory_buffer chunk;
+
+    for (;;)
+    {
+      auto mark = clock::now();
+      bool available = input.pop(chunk);
+      stats.waitNanos += elapsed(mark);
+
+      if (!available)
+        break;
+
+      mark = clock::now();
+      stats.bytesIn += chunk.used();
+
+      size_t done = 0;
+      while (done < chunk.used())
+      {
+        size_t effective = _sink->write(chunk.data() + done, chunk.used() - done);
+
+        if (effective == END_OF_STREAM)
+          throw exceptions::messaged_exception("data_pipeline: sink closed before end of stream");
+
+        done += effective;
+      }
+
+      stats.bytesOut += done;
+      stats.busyNanos += elapsed(mark);
+    }
+
+    _sink->write(nullptr, END_OF_STREAM);
+  }
+
+public:
+  data_pipeline(data_source* source, data_sink* sink, size_t chunkSize = KB64, size_t queueDepth = 4) :
+  _source(source), _sink(sink), _chunkSize(chunkSize), _queueDepth(queueDepth) { }
+
+  /* pipeline takes ownership of the filter */
+  data_pipeline& add(data_filter* filter) { _stages.emplace_back(filter); return *this; }
+
+  template<typename F, typename... Args> data_pipeline& add(Args... args) { return add(new F(args...)); }
+
+  size_t stageCount() const { return _stages.size(); }
+  data_filter* stage(size_t index) const { return _stages[index].get(); }
+
+  void process() override
+  {
+    const size_t count = _stages.size();
+
+    std::vector<std::unique_ptr<chunk_queue>> queues;
+    for (size_t i = 0; i < count + 1; ++i)
+      queues.emplace_back(new chunk_queue(_queueDepth));
+
+    _stats.clear();
+    _stats.emplace_back("source");
+    for (const auto& stage : _stages)
+      _stats.emplace_back(stage->name());
+    _stats.emplace_back("sink");
+
+    _error = nullptr;
+
+    {
+      /* every stage blocks on its queues so each needs a dedicated worker */
+      thread_pool pool(count + 2);
+
+      pool.submit([&] () {
+        try { runSource(*queues[0], _stats[0]); }
+        catch (...) { fail(queues); }
+      });
+
+      for (size_t i = 0; i < count; ++i)
+      {
+        pool.submit([&, i] () {
+          try { runStage(_stages[i].get(), *queues[i], *queues[i+1], _stats[i+1]); }
+          catch (...) { fail(queues); }
+        });
+      }
+
+      pool.submit([&] () {
+        try { runSink(*queues[count], _stats[count+1]); }
+        catch (...) { fail(queues); }
+      });
+
+      pool.wait();
+    }
+
+    TRACE_P("%p: data_pipeline::process() pipeline closed", this);
+
+    if (_error)
+      std::rethrow_exception(_error);
+  }
+
+  /* per-stage counters of the last process() call, first entry is the source and last is the sink */
+  const std::vector<stage_stats>& stats() const { return _stats; }
+};
@@ -32,7 +32,19 @@ struct seekable
   void rewind() { seek(0); }
 };
 
-struct seekable_data_source : public data_source, public seekable { };
+struct seekable_data_source : public data_source, public seekable
+{
+  /* reads at offset without altering current position, implementations backed by pread or
+     memory are safe to call concurrently, this fallback moves the position and isn't */
+  virtual size_t readAt(roff_t offset, byte* dest, size_t amount)
+  {
+    roff_t mark = tell();
+    seek(offset);
+    size_t effective = read(dest, amount);
+    seek(mark);
+    return effective;
+  }
+};
 struct seekable_data_sink : public data_sink, public seekable { };
 struct seekable_data : public data_source, public data_sink, public seekable { };
 struct data : public data_source, public data_sink { };
@@ -90,21 +102,47 @@ class seekable_source_slice : public seekable_data_source
 {
 private:
   seekable_data_source* const _source;
+  const roff_t _offset;
+  const size_t _length;
   roff_t _position;
   
 public:
-  seekable_source_slice(seekable_data_source* source) : _source(source) { }
+  /* length of a slice extending up to the end of the source, which is resolved on each access
+     so that it follows the source while it grows and needn't be open when the slice is built */
+  static constexpr size_t TO_END = END_OF_STREAM;
+  
+  seekable_source_slice(seekable_data_source* source) : seekable_source_slice(source, 0, TO_END) { }
+  seekable_source_slice(seekable_data_source* source, roff_t offset, size_t length) : _source(source), _offset(offset), _length(length), _position(0) { }
   
   virtual void seek(roff_t position) { _position = position; }
   virtual roff_t tell() const { return _position; }
-  virtual size_t size() const { return _source->size(); }
+  
+  virtual size_t size() const
+  {
+    if (_length != TO_END)
+      return _length;
+    
+    const size_t total = _source->size();
+    return total > size_t(_offset) ? total - _offset : 0;
+  }
+  
+  size_t readAt(roff_t offset, byte* dest, size_t amount) override
+  {
+    const size_t length = size();
+    
+    if (offset < 0 || offset >= roff_t(length))
+      return END_OF_STREAM;
+    
+    return _source->readAt(_offset + offset, dest, std::min(amount, size_t(length - offset)));
+  }
+  
   virtual size_t read(byte* dest, size_t amount)
   {
-    roff_t mark = _source->tell();
-    _source->seek(_position);
-    size_t effective = _source->read(dest, amount);
-    _source->seek(mark);
-    _position += effective;
+    size_t effective = readAt(_position, dest, amount);
+    
+    if (effective != END_OF_STREAM)
+      _position += effective;
+    
     return effective;
   }
 };
@@ -123,6 +161,14 @@ private:
   std::vector<data_source*> _sources;
   iterator _it;
   
+protected:
+  const std::vector<data_source*>& sources() const { return _sources; }
+  size_t current() const { return std::distance(_sources.cbegin(), _it); }
+  bool started() const { return _it != _sources.begin() || !_pristine; }
+  
+  /* reads from the current source, overridden by modes which read sources in advance */
+  virtual size_t readCurrent(byte* dest, size_t amount) { return (*_it)->read(dest, amount); }
+  
 public:
   multiple_data_source(const std::vector<data_source*>& sources) :
   _pristine(true), _sources(sources), _it(_sources.begin()),
@@ -147,7 +193,7 @@ public:
         _pristine = false;
       }
       
-      effective = (*_it)->read(dest, amount);
+      effective = readCurrent(dest, amount);
       
       if (effective == END_OF_STREAM)
       {
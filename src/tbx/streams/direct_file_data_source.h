@@ -0,0 +1,447 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+#include "buffer_pool.h"
+
+#include <deque>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(_WIN32)
+#error "direct_file_data_source.h requires POSIX positional I/O"
+#endif
+
+/* file streams bypassing the page cache for long sequential jobs, files are opened with O_DIRECT
+   and accessed through page aligned blocks from buffer_pool with several requests in flight on a
+   thread pool, unaligned positions and tails are handled internally, on file systems refusing
+   O_DIRECT regular I/O is used and pages are dropped from the cache once they've been used */
+namespace direct_io
+{
+  /* covers logical block size of every common device */
+  static constexpr size_t ALIGNMENT = KB4;
+
+  inline u64 alignDown(u64 value) { return value & ~u64(ALIGNMENT - 1); }
+  inline u64 alignUp(u64 value) { return (value + ALIGNMENT - 1) & ~u64(ALIGNMENT - 1); }
+  inline bool aligned(const void* ptr) { return (reinterpret_cast<uintptr_t>(ptr) & (ALIGNMENT - 1)) == 0; }
+
+  /* evicts a range which went through the cache, dirty pages are written out first */
+  inline void drop(int fd, u64 offset, size_t length, bool dirty)
+  {
+    if (dirty)
+      descriptor::writeback(fd, offset, length, true);
+
+    descriptor::drop(fd, offset, length);
+  }
+
+  /* returns bytes read, short only at end of file, buffer, offset and length must be aligned */
+  inline size_t readAt(int fd, byte* dest, size_t length, u64 offset)
+  {
+    size_t done = 0;
+    while (done < length)
+    {
+      ssize_t r = pread(fd, dest + done, length - done, offset + done);
+
+      if (r > 0)
+        done += r;
+      else if (r == 0)
+        break;
+      else if (errno != EINTR)
+        throw exceptions::messaged_exception(fmt::sprintf("direct_io: read failed at %lu (%s)", offset + done, strerror(errno)));
+    }
+
+    return done;
+  }
+
+  inline void writeAt(int fd, const byte* src, size_t length, u64 offset)
+  {
+    size_t done = 0;
+    while (done < length)
+    {
+      ssize_t r = pwrite(fd, src + done, length - done, offset + done);
+
+      if (r > 0)
+        done += r;
+      else if (r == 0 || errno != EINTR)
+        throw exceptions::messaged_exception(fmt::sprintf("direct_io: write failed at %lu (%s)", offset + done, strerror(errno)));
+    }
+  }
+}
+
+/* reads sequentially keeping depth blocks in flight ahead of the current position, seeking
+   outside of the loaded window discards it, readAt() doesn't use the window and can be called
+   concurrently, it reads straight into dest when dest, offset and amount are all aligned */
+class direct_file_data_source : public seekable_data_source
+{
+private:
+  struct request
+  {
+    u64 offset;
+    byte* data;
+    std::future<size_t> done;
+  };
+
+  path _path;
+  int _fd;
+  bool _direct;
+  u64 _length;
+
+  size_t _blockSize;
+  size_t _depth;
+  std::unique_ptr<thread_pool> _pool;
+
+  std::deque<request> _requests;
+  u64 _next;
+
+  byte* _current;
+  u64 _currentOffset;
+  size_t _currentLength;
+
+  roff_t _position;
+
+  void fill()
+  {
+    while (_requests.size() < _depth && _next < _length)
+    {
+      byte* data = buffer_pool::instance().allocate(_blockSize);
+      const u64 offset = _next;
+
+      _requests.push_back({ offset, data, _pool->submit([this, data, offset] () {
+        size_t effective = direct_io::readAt(_fd, data, _blockSize, offset);
+
+        if (!_direct)
+          direct_io::drop(_fd, offset, effective, false);
+
+        return effective;
+      }) });
+
+      _next += _blockSize;
+    }
+  }
+
+  void releaseCurrent()
+  {
+    buffer_pool::instance().release(_current, _blockSize);
+    _current = nullptr;
+    _currentLength = 0;
+  }
+
+  void discard()
+  {
+    for (request& r : _requests)
+    {
+      r.done.wait();
+      buffer_pool::instance().release(r.data, _blockSize);
+    }
+
+    _requests.clear();
+    releaseCurrent();
+  }
+
+  /* makes the block containing position current, false if nothing can be read there */
+  bool advance()
+  {
+    const u64 block = _position - (_position % _blockSize);
+
+    if (!_requests.empty() && _requests.front().offset != block)
+      discard();
+
+    releaseCurrent();
+
+    if (_requests.empty())
+      _next = block;
+
+    fill();
+
+    request r = std::move(_requests.front());
+    _requests.pop_front();
+
+    try
+    {
+      _currentLength = r.done.get();
+    }
+    catch (...)
+    {
+      buffer_pool::instance().release(r.data, _blockSize);
+      throw;
+    }
+
+    _current = r.data;
+    _currentOffset = r.offset;
+
+    fill();
+
+    TRACE_F("%p: direct_file_data_source::advance() block %lu (%lu)", this, _currentOffset, _currentLength);
+    return _position < roff_t(_currentOffset + _currentLength);
+  }
+
+public:
+  direct_file_data_source(const path& path, size_t blockSize = MB1, size_t depth = 4) :
+  _path(path), _fd(-1), _direct(false), _length(0), _blockSize(direct_io::alignUp(blockSize)), _depth(depth),
+  _next(0), _current(nullptr), _currentOffset(0), _currentLength(0), _position(0)
+  {
+    assert(blockSize > 0 && depth > 0);
+
+    _fd = descriptor::open(path, descriptor::mode::READING, &_direct);
+
+    if (_fd < 0)
+      throw exceptions::file_not_found(path);
+
+    struct stat st;
+    _length = fstat(_fd, &st) == 0 ? st.st_size : 0;
+
+    _pool.reset(new thread_pool(depth));
+  }
+
+  direct_file_data_source(const direct_file_data_source&) = delete;
+  direct_file_data_source& operator=(const direct_file_data_source&) = delete;
+
+  ~direct_file_data_source()
+  {
+    discard();
+    _pool.reset();
+    ::close(_fd);
+  }
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (_position >= roff_t(_length))
+      return END_OF_STREAM;
+
+    if (!_current || _position < roff_t(_currentOffset) || _position >= roff_t(_currentOffset + _currentLength))
+    {
+      if (!advance())
+        return END_OF_STREAM;
+    }
+
+    const size_t positionInBlock = _position - _currentOffset;
+    const size_t effective = std::min(amount, _currentLength - positionInBlock);
+
+    memcpy(dest, _current + positionInBlock, effective);
+    _position += effective;
+    return effective;
+  }
+
+  size_t readAt(roff_t offset, byte* dest, size_t amount) override
+  {
+    if (offset < 0 || offset >= roff_t(_length))
+      return END_OF_STREAM;
+
+    amount = std::min({ amount, size_t(_length - offset), _blockSize });
+
+    if (direct_io::aligned(dest) && offset == roff_t(direct_io::alignDown(offset)) && amount == direct_io::alignDown(amount))
+      return direct_io::readAt(_fd, dest, amount, offset);
+
+    const u64 start = direct_io::alignDown(offset);
+    const size_t length = direct_io::alignUp(offset + amount) - start;
+    byte* buffer = buffer_pool::instance().allocate(length);
+    size_t effective;
+
+    try
+    {
+      effective = direct_io::readAt(_fd, buffer, length, start);
+    }
+    catch (...)
+    {
+      buffer_pool::instance().release(buffer, length);
+      throw;
+    }
+
+    effective = effective > offset - start ? std::min(amount, size_t(effective - (offset - start))) : 0;
+    memcpy(dest, buffer + (offset - start), effective);
+    buffer_pool::instance().release(buffer, length);
+
+    return effective ? effective : END_OF_STREAM;
+  }
+
+  void seek(roff_t position) override { _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _length; }
+
+  bool direct() const { return _direct; }
+};
+
+/* writes whole blocks asynchronously keeping at most depth of them in flight, the unaligned
+   tail is padded to the alignment on end of stream and the file is then truncated to the
+   real length, write errors are rethrown by following calls */
+class direct_file_data_sink : public data_sink
+{
+private:
+  struct request
+  {
+    byte* data;
+    std::future<void> done;
+  };
+
+  path _path;
+  int _fd;
+  bool _direct;
+
+  size_t _blockSize;
+  size_t _depth;
+  std::unique_ptr<thread_pool> _pool;
+  std::deque<request> _requests;
+
+  byte* _current;
+  size_t _used;
+  u64 _offset;
+  bool _closed;
+
+  void complete(request& r)
+  {
+    try
+    {
+      r.done.get();
+    }
+    catch (...)
+    {
+      buffer_pool::instance().release(r.data, _blockSize);
+      throw;
+    }
+
+    buffer_pool::instance().release(r.data, _blockSize);
+  }
+
+  void waitAll()
+  {
+    std::exception_ptr error;
+
+    while (!_requests.empty())
+    {
+      try
+      {
+        complete(_requests.front());
+      }
+      catch (...)
+      {
+        if (!error)
+          error = std::current_exception();
+      }
+
+      _requests.pop_front();
+    }
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  void submit(size_t length)
+  {
+    byte* data = _current;
+    const u64 offset = _offset;
+
+    _requests.push_back({ data, _pool->submit([this, data, length, offset] () {
+      direct_io::writeAt(_fd, data, length, offset);
+
+      if (!_direct)
+        direct_io::drop(_fd, offset, length, true);
+    }) });
+
+    _current = nullptr;
+    _used = 0;
+    _offset += length;
+
+    while (_requests.size() > _depth)
+    {
+      request r = std::move(_requests.front());
+      _requests.pop_front();
+      complete(r);
+    }
+  }
+
+  void finish()
+  {
+    _closed = true;
+
+    const u64 length = _offset + _used;
+
+    if (_used)
+    {
+      const size_t padded = direct_io::alignUp(_used);
+      memset(_current + _used, 0, padded - _used);
+      submit(padded);
+    }
+    else
+    {
+      buffer_pool::instance().release(_current, _blockSize);
+      _current = nullptr;
+    }
+
+    waitAll();
+
+    if (ftruncate(_fd, length) != 0)
+      throw exceptions::messaged_exception(fmt::sprintf("direct_file_data_sink: unable to truncate %s", _path.c_str()));
+
+    TRACE_F("%p: direct_file_data_sink::finish() %lu", this, length);
+  }
+
+public:
+  direct_file_data_sink(const path& path, size_t blockSize = MB1, size_t depth = 4) :
+  _path(path), _fd(-1), _direct(false), _blockSize(direct_io::alignUp(blockSize)), _depth(depth),
+  _current(nullptr), _used(0), _offset(0), _closed(false)
+  {
+    assert(blockSize > 0 && depth > 0);
+
+    _fd = descriptor::open(path, descriptor::mode::WRITING, &_direct);
+
+    if (_fd < 0)
+      throw exceptions::error_opening_file(path);
+
+    _pool.reset(new thread_pool(depth));
+  }
+
+  direct_file_data_sink(const direct_file_data_sink&) = delete;
+  direct_file_data_sink& operator=(const direct_file_data_sink&) = delete;
+
+  ~direct_file_data_sink()
+  {
+    if (!_closed)
+    {
+      try
+      {
+        finish();
+      }
+      catch (...)
+      {
+      }
+    }
+
+    _pool.reset();
+    buffer_pool::instance().release(_current, _blockSize);
+    ::close(_fd);
+  }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (_closed)
+      return END_OF_STREAM;
+
+    if (amount == END_OF_STREAM)
+    {
+      finish();
+      return END_OF_STREAM;
+    }
+
+    size_t done = 0;
+    while (done < amount)
+    {
+      if (!_current)
+        _current = buffer_pool::instance().allocate(_blockSize);
+
+      size_t effective = std::min(amount - done, _blockSize - _used);
+      memcpy(_current + _used, src + done, effective);
+      _used += effective;
+      done += effective;
+
+      if (_used == _blockSize)
+        submit(_blockSize);
+    }
+
+    return amount;
+  }
+
+  u64 tell() const { return _offset + _used; }
+  bool direct() const { return _direct; }
+};
@@ -31,6 +31,16 @@ public:
     return effective;
   }
   
+  size_t readAt(roff_t offset, byte* dest, size_t amount) override
+  {
+    if (offset >= roff_t(_length))
+      return END_OF_STREAM;
+    
+    size_t effective = _handle.readAt(dest, std::min(amount, size_t(_length - offset)), offset);
+    TRACE_F("%p: file_data_source::readAt(%lu, %lu/%lu)", this, offset, effective, amount);
+    return effective;
+  }
+  
   void seek(roff_t position) override
   {
     assert(_handle);
@@ -50,6 +60,8 @@ public:
     assert(_handle);
     return _length;
   }
+  
+  const file_handle& handle() const { return _handle; }
 };
 
 class file_data_sink : public data_sink
@@ -77,91 +89,167 @@ public:
     else
       return END_OF_STREAM;
   }
+  
+  const file_handle& handle() const { return _handle; }
 };
 
-#include <list>
-#include <unordered_map>
+#include "page_cache.h"
 
+/* file source which reads through a page_cache, copies share the open file and the cache
+   while keeping their own position so a single cache can serve readers on different threads,
+   sequential and strided page accesses through read() and getPage() are detected per copy
+   and the following pages are loaded in advance on a background thread, readAt() is left
+   out of detection since it can be called concurrently */
 class paged_file_data_source : public seekable_data_source
 {
 private:
+  static constexpr size_t NO_PAGE = END_OF_STREAM;
+  
   size_t _pageSize;
   size_t _maxPages;
-  size_t _cacheSize;
-  std::list<size_t> _lru;
-  std::unordered_map<size_t, std::unique_ptr<byte[]>> _pages;
+  size_t _readAhead;
   
   path _path;
-  file_handle _handle;
+  std::shared_ptr<file_data_source> _file;
+  std::shared_ptr<page_cache> _cache;
+  std::shared_ptr<page_prefetcher> _prefetcher;
   
-  size_t _position;
-  size_t _length;
-  size_t _maxValidPages;
+  roff_t _position;
+  
+  size_t _lastPage;
+  s64 _stride;
+  size_t _streak;
+  
+  /* a stride is trusted after being seen twice in a row, sequential access right away */
+  void access(size_t index)
+  {
+    if (!_prefetcher || index == _lastPage)
+      return;
+    
+    if (_lastPage != NO_PAGE)
+    {
+      s64 stride = s64(index) - s64(_lastPage);
+      
+      if (stride == _stride)
+        ++_streak;
+      else
+      {
+        _stride = stride;
+        _streak = 1;
+      }
+    }
+    
+    _lastPage = index;
+    
+    if (_streak >= 2 || (_stride == 1 && _streak >= 1))
+    {
+      for (size_t i = 1; i <= _readAhead; ++i)
+      {
+        s64 next = s64(index) + _stride * s64(i);
+        
+        if (next < 0 || size_t(next) >= _cache->pageCount())
+          break;
+        
+        _prefetcher->request(next);
+      }
+    }
+  }
   
 public:
-  paged_file_data_source(const path& path, size_t pageSize, size_t maxPages, bool waitForOpen = false) :
-  _pageSize(pageSize), _maxPages(maxPages),
-  _path(path), _handle(waitForOpen ? file_handle(path) : file_handle(path, file_mode::READING)), _length(waitForOpen ? 0 : _handle.length()),
-  _maxValidPages(waitForOpen ? 0 : (_length / _pageSize) + (_length % _pageSize ? 1 : 0)), _position(0)
+  static constexpr size_t DEFAULT_READ_AHEAD = 8;
+  
+  /* read ahead is capped to half the cache so prefetched pages don't evict each other, with
+     waitForOpen the source is empty and reads fail until open() is called */
+  paged_file_data_source(const path& path, size_t pageSize, size_t maxPages, bool waitForOpen = false, size_t readAhead = DEFAULT_READ_AHEAD) :
+  _pageSize(pageSize), _maxPages(maxPages), _readAhead(std::min(readAhead, maxPages / 2)), _path(path), _position(0),
+  _lastPage(NO_PAGE), _stride(0), _streak(0)
   {
-
+    if (!waitForOpen)
+      open();
   }
   
+  paged_file_data_source(const paged_file_data_source& other) :
+  _pageSize(other._pageSize), _maxPages(other._maxPages), _readAhead(other._readAhead), _path(other._path),
+  _file(other._file), _cache(other._cache), _prefetcher(other._prefetcher), _position(0),
+  _lastPage(NO_PAGE), _stride(0), _streak(0) { }
+  
   void open()
   {
-    assert(!_handle);
-    _handle.open(_path, file_mode::READING);
-    _length = _handle.length();
-    _maxValidPages = (_length / _pageSize) + (_length % _pageSize ? 1 : 0);
+    assert(!_file);
+    _file = std::make_shared<file_data_source>(_path);
+    _cache = std::make_shared<page_cache>(_file.get(), _pageSize, _maxPages);
+    
+    if (_readAhead > 0)
+      _prefetcher = std::make_shared<page_prefetcher>(_cache.get(), _readAhead * 2);
+    
     _position = 0;
   }
   
-  void seek(roff_t offset) override { getPage(offset / _pageSize); _position = offset; }
-  size_t size() const override { return _length; }
+  ~paged_file_data_source()
+  {
+    /* background loads must complete before the cache they write to goes away */
+    _prefetcher.reset();
+  }
+  
+  void seek(roff_t offset) override { _position = offset; }
+  size_t size() const override { return _cache ? _cache->size() : 0; }
   roff_t tell() const override { return _position; }
   
-  size_t read(byte* dest, size_t amount) override
+  size_t readAt(roff_t offset, byte* dest, size_t amount) override
   {
-    byte* page = getPage(_position / _pageSize);
+    if (!_cache || offset < 0)
+      return END_OF_STREAM;
+    
+    page_cache::page page = _cache->get(offset / _pageSize);
     
     if (!page)
       return END_OF_STREAM;
     
-    size_t positionInPage = _position % _pageSize;
-    amount = std::min(amount, _pageSize - _position);
+    size_t positionInPage = offset % _pageSize;
+    
+    if (positionInPage >= page.size())
+      return END_OF_STREAM;
+    
+    amount = std::min(amount, page.size() - positionInPage);
     
-    memcpy(dest, page + positionInPage, amount);
+    memcpy(dest, page.data() + positionInPage, amount);
     return amount;
   }
   
-  byte* getPage(size_t index)
+  size_t read(byte* dest, size_t amount) override
   {
-    auto it = _pages.find(index);
+    access(_position / _pageSize);
     
-    /* return page if cached */
-    if (it != _pages.end())
-      return it->second.get();
-
-    /* free one slot from cache if already full */
-    if (_cacheSize == _maxPages)
-    {
-      size_t least = _lru.front();
-      _lru.pop_front();
-      _pages.erase(least);
-    }
+    size_t effective = readAt(_position, dest, amount);
     
-    /* if page is outside file dimension then don't do anything */
-    if (index >= _maxValidPages)
-      return nullptr;
+    if (effective != END_OF_STREAM)
+      _position += effective;
+    
+    return effective;
+  }
+  
+  page_cache::page getPage(size_t index)
+  {
+    if (!_cache)
+      return page_cache::page();
+    
+    access(index);
+    return _cache->get(index);
+  }
+  
+  /* hints that the range will be read soon, pages are loaded in background if there is room */
+  void prefetch(roff_t offset, size_t length)
+  {
+    if (!_prefetcher || length == 0)
+      return;
     
-    byte* page = new byte[_pageSize];
-    _handle.seek(_pageSize * index, SEEK_CUR);
-    _handle.read(page, 1, _pageSize);
-    _pages.emplace(std::make_pair(index, std::unique_ptr<byte[]>(page)));
-    _lru.push_back(index);
+    const size_t first = offset / _pageSize;
+    const size_t last = (offset + length - 1) / _pageSize;
     
-    return page;
+    _prefetcher->request(first, last - first + 1);
   }
   
-  size_t sizeInMemory() const { return _pageSize * _pages.size(); }
+  /* only valid once the source has been opened */
+  page_cache& cache() { assert(_cache); return *_cache; }
+  size_t sizeInMemory() const { return _cache ? _cache->sizeInMemory() : 0; }
 };
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "data_source.h"
+#include "data_filter.h"
+
+#include <tuple>
+#include <utility>
+
+/* chains of filters composed at compile time, filter_chain<F1, F2, ...> owns every stage by value
+   and moves data between them with direct calls, process() is invoked qualified so stages are
+   never dispatched virtually and can be inlined, compared to nesting source_filter<> or sink_filter<>
+   the only virtual calls left are the ones to the outer source or sink at the boundary,
+   stages are default constructed and can be configured through filter<I>() before first use */
+template<typename... Fs>
+class filter_chain
+{
+  static_assert(sizeof...(Fs) > 0, "filter_chain requires at least one filter");
+
+public:
+  static constexpr size_t STAGES = sizeof...(Fs);
+  template<size_t I> using stage_t = typename std::tuple_element<I, std::tuple<Fs...>>::type;
+
+private:
+  template<size_t I> using index = std::integral_constant<size_t, I>;
+
+  std::tuple<Fs...> _filters;
+  bool _started;
+  bool _finalized;
+
+  template<size_t I> stage_t<I>& stage() { return std::get<I>(_filters); }
+
+  void start(index<STAGES>) { }
+  template<size_t I> void start(index<I>)
+  {
+    using F = stage_t<I>;
+    stage<I>().F::init();
+    stage<I>().start();
+    start(index<I + 1>());
+  }
+
+  void finalize(index<STAGES>) { }
+  template<size_t I> void finalize(index<I>)
+  {
+    using F = stage_t<I>;
+    stage<I>().F::finalize();
+    finalize(index<I + 1>());
+  }
+
+  /* moves output of the previous stage into input of stage I, forwarding end of stream */
+  template<size_t I> bool feed(index<I>)
+  {
+    memory_buffer& out = stage<I - 1>().out();
+    memory_buffer& in = stage<I>().in();
+    bool moved = false;
+
+    if (!out.empty() && !in.full())
+    {
+      size_t effective = std::min(out.used(), in.available());
+      memcpy(in.tail(), out.head(), effective);
+      in.advance(effective);
+      out.consume(effective);
+      moved = true;
+    }
+
+    if (out.empty() && stage<I - 1>().finished() && !stage<I>().ended())
+    {
+      stage<I>().markEnded();
+      moved = true;
+    }
+
+    return moved;
+  }
+
+  template<size_t I> bool run(index<I>)
+  {
+    using F = stage_t<I>;
+    F& filter = stage<I>();
+
+    if (filter.finished() || (filter.in().empty() && filter.out().full()))
+      return false;
+
+    const size_t in = filter.in().used(), out = filter.out().used();
+    filter.F::process();
+    return filter.finished() || in != filter.in().used() || out != filter.out().used();
+  }
+
+  /* a single pass over the stages from first to last, true if anything moved */
+  bool pass(index<STAGES>) { return false; }
+  bool pass(index<0>)
+  {
+    bool progress = run(index<0>());
+    return pass(index<1>()) || progress;
+  }
+  template<size_t I> bool pass(index<I>)
+  {
+    bool progress = feed(index<I>());
+    progress = run(index<I>()) || progress;
+    return pass(index<I + 1>()) || progress;
+  }
+
+public:
+  filter_chain() : _started(false), _finalized(false) { }
+  ~filter_chain() { finalize(); }
+
+  filter_chain(const filter_chain&) = delete;
+  filter_chain& operator=(const filter_chain&) = delete;
+
+  template<size_t I> stage_t<I>& filter() { return std::get<I>(_filters); }
+  template<size_t I> const stage_t<I>& filter() const { return std::get<I>(_filters); }
+
+  memory_buffer& in() { return stage<0>().in(); }
+  memory_buffer& out() { return stage<STAGES - 1>().out(); }
+
+  void start()
+  {
+    if (!_started)
+    {
+      start(index<0>());
+      _started = true;
+    }
+  }
+
+  void finalize()
+  {
+    if (_started && !_finalized)
+    {
+      finalize(index<0>());
+      _finalized = true;
+    }
+  }
+
+  void markEnded() { stage<0>().markEnded(); }
+  bool ended() const { return std::get<0>(_filters).ended(); }
+  bool finished() const { return std::get<STAGES - 1>(_filters).finished(); }
+
+  /* runs passes until the last stage has output or nothing can progress anymore, true if anything moved */
+  bool process()
+  {
+    bool progress = false;
+    while (out().empty() && !finished() && pass(index<0>()))
+      progress = true;
+    return progress;
+  }
+};
+
+/* exposes a filter_chain reading from source as a single data_source */
+template<typename... Fs>
+class chain_source : public data_source
+{
+private:
+  data_source* _source;
+  filter_chain<Fs...> _chain;
+
+public:
+  chain_source(data_source* source) : _source(source) { }
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    _chain.start();
+
+    memory_buffer& in = _chain.in();
+    memory_buffer& out = _chain.out();
+
+    while (out.empty() && !_chain.finished())
+    {
+      bool progress = false;
+
+      if (!_chain.ended() && !in.full())
+      {
+        size_t effective = _source->read(in.tail(), in.available());
+
+        if (effective == END_OF_STREAM)
+          _chain.markEnded();
+        else
+          in.advance(effective);
+
+        progress = effective != 0;
+      }
+
+      /* source has nothing available right now and stages can't go further */
+      if (!_chain.process() && !progress)
+        break;
+    }
+
+    if (out.empty())
+    {
+      if (_chain.finished())
+      {
+        _chain.finalize();
+        return END_OF_STREAM;
+      }
+
+      return 0;
+    }
+
+    size_t effective = std::min(out.used(), amount);
+    memcpy(dest, out.head(), effective);
+    out.consume(effective);
+
+    TRACE_P("%p: filter_chain_source::read(%lu/%lu)", this, effective, amount);
+    return effective;
+  }
+
+  filter_chain<Fs...>& chain() { return _chain; }
+  template<size_t I> typename filter_chain<Fs...>::template stage_t<I>& filter() { return _chain.template filter<I>(); }
+};
+
+/* exposes a filter_chain writing to sink as a single data_sink */
+template<typename... Fs>
+class chain_sink : public data_sink
+{
+private:
+  data_sink* _sink;
+  filter_chain<Fs...> _chain;
+
+  /* false if sink didn't accept anything */
+  bool flush()
+  {
+    memory_buffer& out = _chain.out();
+
+    if (out.empty())
+      return true;
+
+    size_t effective = _sink->write(out.head(), out.used());
+
+    if (effective == END_OF_STREAM || effective == 0)
+      return false;
+
+    out.consume(effective);
+    return true;
+  }
+
+public:
+  chain_sink(data_sink* sink) : _sink(sink) { }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    _chain.start();
+
+    memory_buffer& in = _chain.in();
+
+    if (amount == END_OF_STREAM)
+    {
+      _chain.markEnded();
+
+      while (!_chain.finished() || !_chain.out().empty())
+      {
+        bool progress = _chain.process();
+
+        if (!flush() || (!progress && _chain.out().empty()))
+          break;
+      }
+
+      _sink->write(nullptr, END_OF_STREAM);
+      _chain.finalize();
+      return END_OF_STREAM;
+    }
+
+    size_t done = 0;
+    while (done < amount)
+    {
+      size_t effective = std::min(in.available(), amount - done);
+      memcpy(in.tail(), src + done, effective);
+      in.advance(effective);
+      done += effective;
+
+      bool progress = _chain.process() || effective;
+
+      if (!flush() || !progress)
+        break;
+    }
+
+    TRACE_P("%p: filter_chain_sink::write(%lu/%lu)", this, done, amount);
+    return done;
+  }
+
+  filter_chain<Fs...>& chain() { return _chain; }
+  template<size_t I> typename filter_chain<Fs...>::template stage_t<I>& filter() { return _chain.template filter<I>(); }
+};
+
+/* counterpart of lambda_unbuffered_data_filter which keeps the lambda type so that calls are inlined,
+   meant as unbuffered_source_filter<inline_unbuffered_data_filter<L>> */
+template<typename L>
+class inline_unbuffered_data_filter
+{
+private:
+  std::string _name;
+  L _lambda;
+
+public:
+  inline_unbuffered_data_filter(std::string name, L lambda) : _name(name), _lambda(lambda) { }
+
+  void process(const byte* data, size_t amount, size_t effective) { _lambda(data, amount, effective); }
+  std::string name() const { return _name; }
+};
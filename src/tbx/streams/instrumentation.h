@@ -0,0 +1,331 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "data_source.h"
+#include "data_filter.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+/* opt-in counters for sources, sinks and filters, components are wrapped by the instrumented_*
+   decorators whose counters join the process wide registry on their first call made while
+   instrumentation is enabled, until then wrappers cost a flag check and never touch the registry,
+   time of calls which moved data is busy time, time of calls which moved nothing is accounted
+   separately as zero progress time, it includes waiting but waits inside calls which end up
+   moving data are counted as busy */
+namespace instrumentation
+{
+  static constexpr size_t HISTOGRAM_BUCKETS = 48;
+
+  /* bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeroes */
+  class histogram
+  {
+  private:
+    std::atomic<u64> _buckets[HISTOGRAM_BUCKETS];
+
+  public:
+    histogram() { reset(); }
+
+    static size_t bucketFor(u64 value)
+    {
+      size_t bucket = 0;
+      while (value && bucket < HISTOGRAM_BUCKETS - 1)
+      {
+        value >>= 1;
+        ++bucket;
+      }
+      return bucket;
+    }
+
+    void add(u64 value) { _buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed); }
+    void reset() { for (auto& bucket : _buckets) bucket.store(0, std::memory_order_relaxed); }
+
+    std::vector<u64> snapshot() const
+    {
+      std::vector<u64> values(HISTOGRAM_BUCKETS);
+      for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        values[i] = _buckets[i].load(std::memory_order_relaxed);
+      return values;
+    }
+  };
+
+  enum class kind
+  {
+    SOURCE,
+    SINK,
+    FILTER
+  };
+
+  struct snapshot
+  {
+    std::string name;
+    kind type;
+    u64 calls;
+    u64 bytesIn;
+    u64 bytesOut;
+    u64 busyNanos;
+    u64 zeroProgressCalls;
+    u64 zeroProgressNanos;
+    std::vector<u64> callSizes;
+    std::vector<u64> latencies;
+
+    /* bytes per second of busy time, output side for sources and filters, input side for sinks */
+    double throughput() const
+    {
+      const u64 bytes = type == kind::SINK ? bytesIn : bytesOut;
+      return busyNanos ? bytes * 1e9 / busyNanos : 0.0;
+    }
+  };
+
+  class counters
+  {
+  private:
+    std::string _name;
+    kind _type;
+
+    std::atomic<u64> _calls;
+    std::atomic<u64> _bytesIn;
+    std::atomic<u64> _bytesOut;
+    std::atomic<u64> _busyNanos;
+    std::atomic<u64> _zeroProgressCalls;
+    std::atomic<u64> _zeroProgressNanos;
+
+    histogram _callSizes;
+    histogram _latencies;
+
+    std::atomic<bool> _registered;
+
+    friend class registry;
+
+  public:
+    counters(const std::string& name, kind type) : _name(name), _type(type), _registered(false) { reset(); }
+
+    bool registered() const { return _registered.load(std::memory_order_relaxed); }
+
+    void record(size_t bytesIn, size_t bytesOut, u64 nanos)
+    {
+      _calls.fetch_add(1, std::memory_order_relaxed);
+      _bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+      _bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+      if (bytesIn || bytesOut)
+        _busyNanos.fetch_add(nanos, std::memory_order_relaxed);
+      else
+      {
+        _zeroProgressCalls.fetch_add(1, std::memory_order_relaxed);
+        _zeroProgressNanos.fetch_add(nanos, std::memory_order_relaxed);
+      }
+
+      _callSizes.add(std::max(bytesIn, bytesOut));
+      _latencies.add(nanos);
+    }
+
+    void reset()
+    {
+      _calls = 0;
+      _bytesIn = 0;
+      _bytesOut = 0;
+      _busyNanos = 0;
+      _zeroProgressCalls = 0;
+      _zeroProgressNanos = 0;
+      _callSizes.reset();
+      _latencies.reset();
+    }
+
+    instrumentation::snapshot snapshot() const
+    {
+      return { _name, _type, _calls.load(), _bytesIn.load(), _bytesOut.load(), _busyNanos.load(), _zeroProgressCalls.load(), _zeroProgressNanos.load(), _callSizes.snapshot(), _latencies.snapshot() };
+    }
+  };
+
+  class registry
+  {
+  private:
+    std::atomic<bool> _enabled;
+    std::mutex _mutex;
+    std::vector<std::shared_ptr<counters>> _counters;
+
+    registry() : _enabled(false) { }
+
+  public:
+    static registry& instance()
+    {
+      static registry registry;
+      return registry;
+    }
+
+    /* adds counters to the reported ones unless they already are, called on first enabled use */
+    void enroll(const std::shared_ptr<counters>& counter)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if (!counter->_registered.exchange(true))
+        _counters.push_back(counter);
+    }
+
+    bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+    void setEnabled(bool enabled) { _enabled = enabled; }
+
+    /* counters of destroyed components are kept until cleared, live ones enroll again when next used */
+    void clear()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      for (auto& counter : _counters)
+        counter->_registered = false;
+
+      _counters.clear();
+    }
+
+    void reset()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto& counter : _counters)
+        counter->reset();
+    }
+
+    std::vector<instrumentation::snapshot> snapshot()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      std::vector<instrumentation::snapshot> snapshots;
+      for (const auto& counter : _counters)
+        snapshots.push_back(counter->snapshot());
+      return snapshots;
+    }
+
+    std::string toJson()
+    {
+      static const char* kinds[] = { "source", "sink", "filter" };
+
+      auto array = [] (const std::vector<u64>& values) {
+        /* trailing empty buckets are omitted */
+        size_t length = values.size();
+        while (length > 0 && values[length - 1] == 0)
+          --length;
+
+        std::string json = "[";
+        for (size_t i = 0; i < length; ++i)
+          json += fmt::sprintf(i ? ",%lu" : "%lu", values[i]);
+        return json + "]";
+      };
+
+      std::string json = "{\"stages\":[";
+      bool first = true;
+
+      for (const instrumentation::snapshot& s : snapshot())
+      {
+        std::string name;
+        for (char c : s.name)
+        {
+          if (c == '"' || c == '\\')
+            name += '\\';
+          name += c;
+        }
+
+        json += fmt::sprintf("%s{\"name\":\"%s\",\"kind\":\"%s\",\"calls\":%lu,\"bytesIn\":%lu,\"bytesOut\":%lu,\"busyNanos\":%lu,\"zeroProgressCalls\":%lu,\"zeroProgressNanos\":%lu,\"throughput\":%.0f,\"callSizes\":%s,\"latencies\":%s}",
+                             first ? "" : ",", name, kinds[static_cast<size_t>(s.type)], s.calls, s.bytesIn, s.bytesOut,
+                             s.busyNanos, s.zeroProgressCalls, s.zeroProgressNanos, s.throughput(), array(s.callSizes), array(s.latencies));
+        first = false;
+      }
+
+      return json + "]}";
+    }
+  };
+
+  inline bool enabled() { return registry::instance().enabled(); }
+  inline void setEnabled(bool enabled) { registry::instance().setEnabled(enabled); }
+
+  inline counters& track(const std::shared_ptr<counters>& counter)
+  {
+    if (!counter->registered())
+      registry::instance().enroll(counter);
+    return *counter;
+  }
+
+  using clock = std::chrono::steady_clock;
+  inline u64 elapsed(clock::time_point since) { return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - since).count(); }
+}
+
+class instrumented_source : public data_source
+{
+private:
+  data_source* _source;
+  std::shared_ptr<instrumentation::counters> _counters;
+
+public:
+  instrumented_source(data_source* source, const std::string& name) : _source(source),
+  _counters(std::make_shared<instrumentation::counters>(name, instrumentation::kind::SOURCE)) { }
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (!instrumentation::enabled())
+      return _source->read(dest, amount);
+
+    auto mark = instrumentation::clock::now();
+    size_t effective = _source->read(dest, amount);
+    instrumentation::track(_counters).record(0, effective != END_OF_STREAM ? effective : 0, instrumentation::elapsed(mark));
+    return effective;
+  }
+
+  const instrumentation::counters& counters() const { return *_counters; }
+};
+
+class instrumented_sink : public data_sink
+{
+private:
+  data_sink* _sink;
+  std::shared_ptr<instrumentation::counters> _counters;
+
+public:
+  instrumented_sink(data_sink* sink, const std::string& name) : _sink(sink),
+  _counters(std::make_shared<instrumentation::counters>(name, instrumentation::kind::SINK)) { }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (!instrumentation::enabled() || amount == END_OF_STREAM)
+      return _sink->write(src, amount);
+
+    auto mark = instrumentation::clock::now();
+    size_t effective = _sink->write(src, amount);
+    instrumentation::track(_counters).record(effective != END_OF_STREAM ? effective : 0, 0, instrumentation::elapsed(mark));
+    return effective;
+  }
+
+  const instrumentation::counters& counters() const { return *_counters; }
+};
+
+/* wraps a filter type so it can be used anywhere F is, as in source_filter<instrumented_filter<F>>,
+   bytes are measured as input consumed and output produced by each process() call */
+template<typename F>
+class instrumented_filter : public F
+{
+private:
+  std::shared_ptr<instrumentation::counters> _counters;
+
+public:
+  template<typename... Args> instrumented_filter(Args&&... args) : F(std::forward<Args>(args)...),
+  _counters(std::make_shared<instrumentation::counters>(F::name(), instrumentation::kind::FILTER)) { }
+
+  void process() override
+  {
+    if (!instrumentation::enabled())
+    {
+      F::process();
+      return;
+    }
+
+    const size_t in = this->in().used(), out = this->out().used();
+    auto mark = instrumentation::clock::now();
+
+    F::process();
+
+    const u64 nanos = instrumentation::elapsed(mark);
+    const size_t consumed = in > this->in().used() ? in - this->in().used() : 0;
+    const size_t produced = this->out().used() > out ? this->out().used() - out : 0;
+    instrumentation::track(_counters).record(consumed, produced, nanos);
+  }
+
+  const instrumentation::counters& counters() const { return *_counters; }
+};
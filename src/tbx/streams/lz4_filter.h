@@ -0,0 +1,374 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/formats/compression/lz4/lz4.h"
+#include "tbx/hash/hash.h"
+#include "data_filter.h"
+
+#include <cstring>
+
+/* LZ4 frame compressor, blocks are compressed independently and stored raw
+   when compression doesn't help, checksums are xxHash32 as mandated by the format */
+class lz4_compress_filter : public data_filter
+{
+private:
+  lz4::block_size _blockSize;
+  bool _contentChecksum;
+  bool _blockChecksum;
+  int _acceleration;
+
+  hash::xxh32_digester _digester;
+  std::unique_ptr<byte[]> _scratch;
+  bool _headerWritten;
+
+  static size_t outputSize(size_t blockSize) { return lz4::MAX_HEADER_SIZE + 4 + lz4::compressBound(blockSize) + 4 + 4 + 4; }
+
+  void writeHeader()
+  {
+    byte* header = _out.tail();
+
+    hidden::writeLE32(header, lz4::FRAME_MAGIC);
+    header[4] = (1 << 6) | (1 << 5) | (_blockChecksum ? 1 << 4 : 0) | (_contentChecksum ? 1 << 2 : 0);
+    header[5] = static_cast<u8>(_blockSize) << 4;
+    header[6] = (hash::xxh32_digester::compute(header + 4, 2) >> 8) & 0xFF;
+
+    _out.advance(7);
+  }
+
+  void writeBlock()
+  {
+    const size_t length = _in.used();
+    byte* dest = _out.tail();
+
+    size_t compressed = lz4::compress(_in.head(), length, _scratch.get(), _acceleration);
+
+    byte* data = dest + 4;
+    u32 size;
+
+    if (compressed < length)
+    {
+      memcpy(data, _scratch.get(), compressed);
+      size = static_cast<u32>(compressed);
+    }
+    else
+    {
+      memcpy(data, _in.head(), length);
+      size = static_cast<u32>(length) | lz4::UNCOMPRESSED_BLOCK_FLAG;
+    }
+
+    const size_t stored = size & ~lz4::UNCOMPRESSED_BLOCK_FLAG;
+    hidden::writeLE32(dest, size);
+
+    if (_blockChecksum)
+      hidden::writeLE32(data + stored, hash::xxh32_digester::compute(data, stored));
+
+    if (_contentChecksum)
+      _digester.update(_in.head(), length);
+
+    _out.advance(4 + stored + (_blockChecksum ? 4 : 0));
+    _in.consume(length);
+  }
+
+public:
+  lz4_compress_filter(lz4::block_size blockSize = lz4::block_size::KB64, bool contentChecksum = true, bool blockChecksum = false, int acceleration = 1) :
+  data_filter(lz4::blockSizeInBytes(blockSize), outputSize(lz4::blockSizeInBytes(blockSize))),
+  _blockSize(blockSize), _contentChecksum(contentChecksum), _blockChecksum(blockChecksum), _acceleration(acceleration), _headerWritten(false) { }
+
+  void init() override
+  {
+    _scratch.reset(new byte[lz4::compressBound(_in.capacity())]);
+    _digester.reset();
+    _headerWritten = false;
+  }
+
+  void process() override
+  {
+    if (!_headerWritten)
+    {
+      if (_out.available() < lz4::MAX_HEADER_SIZE)
+        return;
+
+      writeHeader();
+      _headerWritten = true;
+    }
+
+    /* a whole block must fit in output, otherwise wait for it to be drained */
+    if ((_in.full() || (ended() && !_in.empty())) && _out.available() >= outputSize(_in.used()))
+      writeBlock();
+
+    if (ended() && _in.empty() && _out.available() >= 8)
+    {
+      hidden::writeLE32(_out.tail(), 0);
+      _out.advance(4);
+
+      if (_contentChecksum)
+      {
+        hidden::writeLE32(_out.tail(), _digester.get());
+        _out.advance(4);
+      }
+
+      markFinished();
+    }
+  }
+
+  void finalize() override { _scratch.reset(); }
+
+  std::string name() override { return "lz4_compress"; }
+};
+
+/* LZ4 frame decompressor, supports linked and independent blocks, optional checksums,
+   skippable frames and concatenated frames, dictionary ids are not supported */
+class lz4_decompress_filter : public data_filter
+{
+private:
+  enum class state
+  {
+    HEADER,
+    BLOCK,
+    CONTENT_CHECKSUM,
+    SKIP,
+    FRAME_END
+  };
+
+  state _state;
+
+  bool _independent;
+  bool _blockChecksum;
+  bool _contentChecksum;
+  size_t _blockSize;
+  size_t _skip;
+
+  hash::xxh32_digester _digester;
+
+  /* decoded data is kept after the last 64KB of history so linked blocks can refer to it */
+  std::unique_ptr<byte[]> _window;
+  size_t _windowCapacity;
+  size_t _history;
+  size_t _decoded;
+  size_t _emitted;
+
+  [[noreturn]] static void error(const char* message) { throw exceptions::file_format_error(fmt::sprintf("lz4_decompress_filter: %s", message)); }
+
+  bool parseHeader()
+  {
+    if (_in.used() < 4)
+      return false;
+
+    const u32 magic = hidden::readLE32(_in.head());
+
+    if ((magic & lz4::SKIPPABLE_MAGIC_MASK) == lz4::SKIPPABLE_MAGIC)
+    {
+      if (_in.used() < 8)
+        return false;
+
+      _skip = hidden::readLE32(_in.head() + 4);
+      _in.consume(8);
+      _state = state::SKIP;
+      return true;
+    }
+    else if (magic != lz4::FRAME_MAGIC)
+      error("invalid frame magic");
+
+    if (_in.used() < 7)
+      return false;
+
+    const byte flags = _in.head()[4];
+    const byte descriptor = _in.head()[5];
+
+    if ((flags >> 6) != 1)
+      error("unsupported frame version");
+    if (flags & 0x01)
+      error("dictionary ids are not supported");
+
+    const size_t headerSize = 7 + ((flags & 0x08) ? 8 : 0);
+
+    if (_in.used() < headerSize)
+      return false;
+
+    if (((hash::xxh32_digester::compute(_in.head() + 4, headerSize - 5) >> 8) & 0xFF) != _in.head()[headerSize - 1])
+      error("header checksum mismatch");
+
+    const u8 size = (descriptor >> 4) & 0x07;
+    if (size < static_cast<u8>(lz4::block_size::KB64))
+      error("invalid block size");
+
+    _independent = (flags & 0x20) != 0;
+    _blockChecksum = (flags & 0x10) != 0;
+    _contentChecksum = (flags & 0x04) != 0;
+    _blockSize = lz4::blockSizeInBytes(static_cast<lz4::block_size>(size));
+
+    /* whole blocks must fit in input buffer */
+    if (_in.capacity() < _blockSize + 8)
+      resizeIn(_blockSize + 8);
+
+    if (_windowCapacity < lz4::HISTORY_SIZE + _blockSize)
+    {
+      _windowCapacity = lz4::HISTORY_SIZE + _blockSize;
+      _window.reset(new byte[_windowCapacity]);
+    }
+
+    _history = 0;
+    _digester.reset();
+
+    _in.consume(headerSize);
+    _state = state::BLOCK;
+    return true;
+  }
+
+  bool parseBlock()
+  {
+    if (_in.used() < 4)
+      return false;
+
+    const u32 header = hidden::readLE32(_in.head());
+
+    if (header == 0)
+    {
+      _in.consume(4);
+      _state = _contentChecksum ? state::CONTENT_CHECKSUM : state::FRAME_END;
+      return true;
+    }
+
+    const bool uncompressed = (header & lz4::UNCOMPRESSED_BLOCK_FLAG) != 0;
+    const size_t size = header & ~lz4::UNCOMPRESSED_BLOCK_FLAG;
+    const size_t total = 4 + size + (_blockChecksum ? 4 : 0);
+
+    if (size > _blockSize)
+      error("block is larger than declared maximum");
+
+    if (_in.used() < total)
+      return false;
+
+    const byte* data = _in.head() + 4;
+
+    if (_blockChecksum && hash::xxh32_digester::compute(data, size) != hidden::readLE32(data + size))
+      error("block checksum mismatch");
+
+    if (_independent)
+      _history = 0;
+
+    byte* dest = _window.get() + _history;
+
+    if (uncompressed)
+    {
+      memcpy(dest, data, size);
+      _decoded = size;
+    }
+    else
+      _decoded = lz4::decompress(data, size, dest, _blockSize, _history);
+
+    _emitted = 0;
+
+    if (_contentChecksum)
+      _digester.update(dest, _decoded);
+
+    _in.consume(total);
+    return true;
+  }
+
+  /* moves decoded data to output, returns true once everything has been flushed */
+  bool flushPending()
+  {
+    if (_emitted < _decoded)
+    {
+      size_t effective = std::min(_decoded - _emitted, _out.available());
+      memcpy(_out.tail(), _window.get() + _history + _emitted, effective);
+      _out.advance(effective);
+      _emitted += effective;
+    }
+
+    if (_decoded && _emitted == _decoded)
+    {
+      _history += _decoded;
+      _decoded = 0;
+      _emitted = 0;
+
+      /* keep only the last 64KB of history at the beginning of the window */
+      if (_history > lz4::HISTORY_SIZE)
+      {
+        memmove(_window.get(), _window.get() + _history - lz4::HISTORY_SIZE, lz4::HISTORY_SIZE);
+        _history = lz4::HISTORY_SIZE;
+      }
+    }
+
+    return _decoded == 0;
+  }
+
+public:
+  lz4_decompress_filter(size_t bufferSize = KB64) : data_filter(bufferSize),
+  _state(state::HEADER), _independent(false), _blockChecksum(false), _contentChecksum(false), _blockSize(0), _skip(0),
+  _windowCapacity(0), _history(0), _decoded(0), _emitted(0) { }
+
+  void init() override
+  {
+    _state = state::HEADER;
+    _decoded = 0;
+    _emitted = 0;
+    _history = 0;
+  }
+
+  void process() override
+  {
+    for (;;)
+    {
+      if (!flushPending())
+        return;
+
+      bool progress = false;
+
+      switch (_state)
+      {
+        case state::HEADER: progress = parseHeader(); break;
+        case state::BLOCK: progress = parseBlock(); break;
+        case state::SKIP:
+        {
+          size_t effective = std::min(_skip, _in.used());
+          _in.consume(effective);
+          _skip -= effective;
+          if (_skip == 0)
+            _state = state::FRAME_END;
+          progress = effective > 0 || _skip == 0;
+          break;
+        }
+        case state::CONTENT_CHECKSUM:
+        {
+          if (_in.used() >= 4)
+          {
+            if (hidden::readLE32(_in.head()) != _digester.get())
+              error("content checksum mismatch");
+            _in.consume(4);
+            _state = state::FRAME_END;
+            progress = true;
+          }
+          break;
+        }
+        case state::FRAME_END:
+        {
+          /* another frame may follow */
+          if (!_in.empty())
+          {
+            _state = state::HEADER;
+            progress = true;
+          }
+          else if (ended())
+          {
+            markFinished();
+            return;
+          }
+          break;
+        }
+      }
+
+      if (!progress)
+      {
+        if (ended() && _state != state::FRAME_END)
+          error("unexpected end of stream");
+        return;
+      }
+    }
+  }
+
+  void finalize() override { }
+
+  std::string name() override { return "lz4_decompress"; }
+};
@@ -2,6 +2,7 @@
 
 #include "tbx/base/common.h"
 #include "tbx/streams/data_source.h"
+#include "tbx/streams/buffer_pool.h"
 
 enum class Seek
 {
@@ -13,6 +14,7 @@ enum class Seek
 template<typename T> class data_reference;
 template<typename T> class array_reference;
 
+/* owned storage is drawn from and returned to buffer_pool */
 class memory_buffer : public seekable_data_source, public data_sink
 {
 private:
@@ -24,8 +26,28 @@ private:
   
   bool _dataOwned;
   
+  static byte* allocate(size_t capacity) { return buffer_pool::instance().allocate(capacity); }
+  static void release(byte* data, size_t capacity) { buffer_pool::instance().release(data, capacity); }
+  
+  /* large buffers grow in place through buffer_pool instead of being copied,
+     external data is copied into an owned block */
+  void reallocate(size_t capacity)
+  {
+    if (_dataOwned)
+      _data = buffer_pool::instance().reallocate(_data, _capacity, _size, capacity);
+    else
+    {
+      byte* data = allocate(capacity);
+      std::copy(_data, _data + std::min(_size, capacity), data);
+      _data = data;
+      _dataOwned = true;
+    }
+    
+    _capacity = capacity;
+  }
+  
 public:
-  memory_buffer(size_t capacity) : _data(new byte[capacity]), _capacity(capacity), _size(0), _position(0), _dataOwned(true)
+  memory_buffer(size_t capacity) : _data(allocate(capacity)), _capacity(capacity), _size(0), _position(0), _dataOwned(true)
   {
     TRACE_MB("%p: memory_buffer::new(%lu)", this, capacity);
   }
@@ -38,7 +60,7 @@ public:
   
   memory_buffer(const byte* data, size_t length) : _capacity(length), _size(length), _position(0), _dataOwned(true)
   {
-    _data = new byte[length];
+    _data = allocate(length);
     std::copy(data, data + length, _data);
     TRACE_MB("%p: memory_buffer::new(ptr, %lu)", this, length);
   }
@@ -49,7 +71,7 @@ public:
   {
     if (copy)
     {
-      _data = new byte[length];
+      _data = allocate(length);
       std::copy(data, data + length, _data);
     }
   }
@@ -70,7 +92,7 @@ public:
   {
     if (_dataOwned)
     {
-      delete [] _data;
+      release(_data, _capacity);
     }
     
     _data = other._data;
@@ -90,7 +112,7 @@ public:
   memory_buffer& operator=(memory_buffer&) = delete;
 
   
-  ~memory_buffer() { if (_dataOwned) delete [] _data; }
+  ~memory_buffer() { if (_dataOwned) release(_data, _capacity); }
   
   byte operator[](size_t index) const { return _data[index]; }
   
@@ -133,22 +155,18 @@ public:
     if (capacity > _capacity)
     {
       TRACE_MB("%p: memory_buffer::ensure_capacity (old: %lu, new: %lu)", this, _capacity, capacity);
-      //TODO: this may fail and must be managed
-      byte* newData = new byte[capacity];
-      memset(newData, 0, capacity);
-      std::copy(_data, _data+_size, newData);
-      delete[] _data;
-      this->_data = newData;
-      this->_capacity = capacity;
+      reallocate(capacity);
     }
   }
 
   template<typename T> data_reference<T> reserve();
   template<typename T> array_reference<T> reserveArray(size_t size);
   
+  /* reserved bytes are zeroed since they may be never written */
   void reserve(size_t size)
   {
     ensure_capacity(_position + size);
+    memset(_data + _position, 0, size);
     _position += size;
     _size += size;
   }
@@ -164,6 +182,10 @@ public:
       ensure_capacity(_capacity + delta);
     }
 
+    /* a gap left by seeking past the end reads as zeros, pool blocks are recycled without clearing */
+    if (size_t(_position) > _size)
+      memset(_data + _size, 0, _position - _size);
+
     std::copy((const byte*)data, (const byte*)data + (size*count), _data+_position);
     _position += count*size;
     _size = std::max(_size, (size_t)_position);
@@ -183,11 +205,7 @@ public:
   {
     if (_capacity > _size)
     {
-      byte* data = new byte[_size];
-      std::copy(_data, _data + _size, data);
-      delete [] _data;
-      _data = data;
-      _capacity = _size;
+      reallocate(_size);
     }
     
     return *this;
@@ -228,6 +246,16 @@ public:
     return read(data, 1, amount);
   }
   
+  size_t readAt(roff_t offset, byte* data, size_t amount) override
+  {
+    if (offset < 0 || offset >= roff_t(_size))
+      return END_OF_STREAM;
+    
+    size_t available = std::min(_size - size_t(offset), amount);
+    std::copy(_data + offset, _data + offset + available, data);
+    return available;
+  }
+  
   size_t write(const byte* data, size_t amount) override
   {
     if (amount != END_OF_STREAM)
@@ -247,13 +275,7 @@ public:
     if (newCapacity > _capacity)
     {
       assert(_dataOwned);
-      //TODO: this may fail and must be managed
-      byte* data = new byte[newCapacity];
-      std::copy(_data, _data + _size, data);
-      delete [] _data;
-      _data = data;
-      
-      _capacity = newCapacity;
+      reallocate(newCapacity);
     }
   }
   
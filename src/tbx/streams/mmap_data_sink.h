@@ -0,0 +1,222 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/file_system.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+
+#include <deque>
+
+#if defined(_WIN32)
+#error "mmap_data_sink.h requires POSIX memory mapping"
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* file sink writing through a shared mapping of a window of the file instead of stdio, the expected
+   size is reserved up front with FileSystem::fallocate and the file grows by whole windows past it,
+   space is always allocated before being mapped so running out of disk fails a write instead of
+   faulting on it, when the position leaves the window a new one is mapped while writeback of the
+   previous one is started and the window released on a background thread, at most maxPendingFlushes
+   windows are pending, finalize truncates the file to the highest position written */
+class mmap_data_sink : public seekable_data_sink
+{
+private:
+  struct window
+  {
+    byte* data;
+    u64 offset;
+    size_t length;
+  };
+
+  path _path;
+  int _fd;
+  size_t _windowSize;
+  size_t _maxPendingFlushes;
+
+  u64 _capacity;
+  u64 _length;
+  roff_t _position;
+
+  window _window;
+
+  std::unique_ptr<thread_pool> _flusher;
+  std::deque<std::future<bool>> _flushes;
+  bool _flushFailed;
+  bool _closed;
+
+  [[noreturn]] void error(const char* message) const
+  {
+    throw exceptions::messaged_exception(fmt::sprintf("mmap_data_sink: %s %s (%s)", message, _path.c_str(), strerror(errno)));
+  }
+
+  void reserve(u64 end)
+  {
+    if (end <= _capacity)
+      return;
+
+    const int r = descriptor::allocate(_fd, _capacity, end - _capacity);
+
+    if (r != 0)
+    {
+      errno = r;
+      error("unable to reserve space for");
+    }
+
+    _capacity = end;
+  }
+
+  void collect(size_t pending)
+  {
+    while (_flushes.size() > pending)
+    {
+      _flushFailed |= !_flushes.front().get();
+      _flushes.pop_front();
+    }
+  }
+
+  /* writeback is started for windows left behind to bound dirty memory, the last one is left to the kernel */
+  void release(bool writeback)
+  {
+    if (!_window.data)
+      return;
+
+    window w = _window;
+    _window = { nullptr, 0, 0 };
+
+    const int fd = _fd;
+    _flushes.push_back(_flusher->submit([w, fd, writeback] () {
+      /* writeback isn't waited for, durability is left to the caller */
+      bool success = !writeback || msync(w.data, w.length, MS_ASYNC) == 0;
+      if (writeback)
+        descriptor::writeback(fd, w.offset, w.length, false);
+#if defined(MADV_DONTNEED)
+      madvise(w.data, w.length, MADV_DONTNEED);
+#endif
+      return munmap(w.data, w.length) == 0 && success;
+    }));
+
+    TRACE_F("%p: mmap_data_sink::release() %lu %lu", this, w.offset, w.length);
+    collect(_maxPendingFlushes);
+  }
+
+  /* maps the window containing the current position */
+  void map()
+  {
+    const u64 offset = _position - (_position % _windowSize);
+
+    release(true);
+    reserve(offset + _windowSize);
+
+    void* data = mmap(nullptr, _windowSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, offset);
+
+    if (data == MAP_FAILED)
+      error("unable to map");
+
+    _window = { static_cast<byte*>(data), offset, _windowSize };
+    TRACE_F("%p: mmap_data_sink::map() %lu %lu", this, offset, _windowSize);
+  }
+
+  void finalize()
+  {
+    _closed = true;
+
+    release(false);
+    collect(0);
+
+    if (ftruncate(_fd, _length) != 0)
+      error("unable to truncate");
+
+    if (::close(_fd) != 0)
+      error("unable to close");
+
+    _fd = -1;
+
+    if (_flushFailed)
+      throw exceptions::messaged_exception(fmt::sprintf("mmap_data_sink: unable to flush %s", _path.c_str()));
+  }
+
+public:
+  /* windowSize is rounded up to the page size */
+  mmap_data_sink(const path& path, size_t expectedSize = 0, size_t windowSize = MB64, size_t maxPendingFlushes = 2) :
+  _path(path), _fd(-1), _maxPendingFlushes(maxPendingFlushes), _capacity(0), _length(0), _position(0),
+  _window({ nullptr, 0, 0 }), _flusher(new thread_pool(1)), _flushFailed(false), _closed(false)
+  {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    _windowSize = (std::max(windowSize, page) + page - 1) / page * page;
+
+    const bool reserved = expectedSize && FileSystem::i()->fallocate(path, expectedSize);
+
+    /* shared writable mappings need the file opened for reading too */
+    _fd = descriptor::open(path, descriptor::mode::UPDATING);
+
+    if (_fd >= 0 && !reserved && ftruncate(_fd, 0) != 0)
+    {
+      ::close(_fd);
+      _fd = -1;
+    }
+
+    if (_fd < 0)
+      throw exceptions::error_opening_file(path);
+
+    struct stat st;
+    _capacity = fstat(_fd, &st) == 0 ? st.st_size : 0;
+  }
+
+  mmap_data_sink(const mmap_data_sink&) = delete;
+  mmap_data_sink& operator=(const mmap_data_sink&) = delete;
+
+  ~mmap_data_sink()
+  {
+    if (!_closed)
+    {
+      try
+      {
+        finalize();
+      }
+      catch (...)
+      {
+      }
+    }
+
+    _flusher.reset();
+
+    if (_fd >= 0)
+      ::close(_fd);
+  }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (_closed)
+      return END_OF_STREAM;
+
+    if (amount == END_OF_STREAM)
+    {
+      finalize();
+      return END_OF_STREAM;
+    }
+
+    size_t done = 0;
+    while (done < amount)
+    {
+      if (!_window.data || u64(_position) < _window.offset || u64(_position) >= _window.offset + _window.length)
+        map();
+
+      const size_t positionInWindow = _position - _window.offset;
+      const size_t effective = std::min(amount - done, _window.length - positionInWindow);
+
+      memcpy(_window.data + positionInWindow, src + done, effective);
+      _position += effective;
+      done += effective;
+    }
+
+    _length = std::max(_length, u64(_position));
+    return amount;
+  }
+
+  void seek(roff_t position) override { assert(position >= 0); _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _length; }
+};
@@ -0,0 +1,400 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/* fixed size page cache over a seekable source, memory for all pages is allocated once
+   and split between independently locked shards which evict with the CLOCK algorithm,
+   pages are returned pinned and can't be evicted while a handle to them is alive,
+   pages are loaded through readAt so the source must support concurrent positional reads
+   for the cache to be shared between threads */
+class page_cache
+{
+public:
+  struct statistics
+  {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 prefetches;
+  };
+
+private:
+  static constexpr size_t INVALID_INDEX = END_OF_STREAM;
+
+  enum class state
+  {
+    EMPTY,
+    LOADING,
+    READY
+  };
+
+  struct shard;
+
+  struct frame
+  {
+    shard* owner;
+    byte* data;
+    size_t index;
+    size_t length;
+    u32 pins;
+    bool referenced;
+    state status;
+  };
+
+  struct shard
+  {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<frame> frames;
+    std::unordered_map<size_t, frame*> mapping;
+    size_t hand;
+  };
+
+public:
+  class page
+  {
+  private:
+    page_cache* _cache;
+    frame* _frame;
+
+    page(page_cache* cache, frame* frame) : _cache(cache), _frame(frame) { }
+
+  public:
+    page() : _cache(nullptr), _frame(nullptr) { }
+    page(page&& other) : _cache(other._cache), _frame(other._frame) { other._frame = nullptr; }
+    page& operator=(page&& other) { release(); _cache = other._cache; _frame = other._frame; other._frame = nullptr; return *this; }
+    page(const page&) = delete;
+    page& operator=(const page&) = delete;
+    ~page() { release(); }
+
+    void release()
+    {
+      if (_frame)
+      {
+        _cache->unpin(_frame);
+        _frame = nullptr;
+      }
+    }
+
+    const byte* data() const { return _frame->data; }
+    size_t size() const { return _frame->length; }
+    size_t index() const { return _frame->index; }
+
+    explicit operator bool() const { return _frame != nullptr; }
+
+    friend class page_cache;
+  };
+
+private:
+  seekable_data_source* _source;
+  size_t _pageSize;
+  size_t _maxPages;
+  size_t _pageCount;
+  size_t _length;
+
+  std::unique_ptr<byte[]> _slab;
+  std::vector<std::unique_ptr<shard>> _shards;
+
+  std::atomic<u64> _hits;
+  std::atomic<u64> _misses;
+  std::atomic<u64> _evictions;
+  std::atomic<u64> _prefetches;
+  std::atomic<size_t> _resident;
+
+  shard& shardFor(size_t index) { return *_shards[index % _shards.size()]; }
+
+  /* CLOCK: skip pinned and loading frames, give referenced ones a second chance */
+  frame* victim(shard& s)
+  {
+    const size_t count = s.frames.size();
+
+    for (size_t i = 0; i < count * 2; ++i)
+    {
+      frame& f = s.frames[s.hand];
+      s.hand = (s.hand + 1) % count;
+
+      if (f.pins > 0 || f.status == state::LOADING)
+        continue;
+      else if (f.referenced)
+        f.referenced = false;
+      else
+        return &f;
+    }
+
+    return nullptr;
+  }
+
+  size_t load(size_t index, byte* dest)
+  {
+    const roff_t offset = roff_t(index) * _pageSize;
+    const size_t length = std::min(_pageSize, _length - size_t(offset));
+
+    size_t done = 0;
+    while (done < length)
+    {
+      size_t effective = _source->readAt(offset + done, dest + done, length - done);
+
+      if (effective == END_OF_STREAM || effective == 0)
+        throw exceptions::messaged_exception("page_cache: unexpected end of source");
+
+      done += effective;
+    }
+
+    return length;
+  }
+
+  void unpin(frame* f)
+  {
+    shard& s = *f->owner;
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    if (--f->pins == 0)
+      s.changed.notify_all();
+  }
+
+  /* pins the frame for index, when not blocking only loads missing pages and gives up
+     instead of waiting for other threads, so a null frame is returned for present pages too */
+  frame* acquire(size_t index, bool blocking)
+  {
+    shard& s = shardFor(index);
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    for (;;)
+    {
+      auto it = s.mapping.find(index);
+
+      if (it != s.mapping.end())
+      {
+        frame* f = it->second;
+
+        if (!blocking)
+          return nullptr;
+
+        /* another thread is reading it */
+        if (f->status == state::LOADING)
+        {
+          s.changed.wait(lock);
+          continue;
+        }
+
+        ++f->pins;
+        f->referenced = true;
+        ++_hits;
+        return f;
+      }
+
+      frame* f = victim(s);
+
+      /* every frame of the shard is pinned */
+      if (!f)
+      {
+        if (!blocking)
+          return nullptr;
+
+        s.changed.wait(lock);
+        continue;
+      }
+
+      if (f->status == state::READY)
+      {
+        s.mapping.erase(f->index);
+        ++_evictions;
+      }
+      else
+        ++_resident;
+
+      f->index = index;
+      f->status = state::LOADING;
+      f->pins = 1;
+      f->referenced = true;
+      s.mapping[index] = f;
+      ++(blocking ? _misses : _prefetches);
+
+      lock.unlock();
+
+      try
+      {
+        f->length = load(index, f->data);
+      }
+      catch (...)
+      {
+        lock.lock();
+        s.mapping.erase(index);
+        f->index = INVALID_INDEX;
+        f->status = state::EMPTY;
+        f->pins = 0;
+        --_resident;
+        s.changed.notify_all();
+        throw;
+      }
+
+      lock.lock();
+      f->status = state::READY;
+      s.changed.notify_all();
+
+      return f;
+    }
+  }
+
+public:
+  page_cache(seekable_data_source* source, size_t pageSize, size_t maxPages, size_t shards = 0) :
+  _source(source), _pageSize(pageSize), _maxPages(maxPages), _length(source->size()),
+  _hits(0), _misses(0), _evictions(0), _prefetches(0), _resident(0)
+  {
+    assert(pageSize > 0 && maxPages > 0);
+
+    _pageCount = (_length / _pageSize) + (_length % _pageSize ? 1 : 0);
+
+    if (shards == 0)
+      shards = utils::nextPowerOfTwo(std::thread::hardware_concurrency());
+    shards = std::max(size_t(1), std::min(shards, maxPages));
+
+    _slab.reset(new byte[_pageSize * _maxPages]);
+
+    size_t next = 0;
+    for (size_t i = 0; i < shards; ++i)
+    {
+      shard* s = new shard();
+      s->hand = 0;
+
+      /* pages are split as evenly as possible between shards */
+      const size_t frames = maxPages / shards + (i < maxPages % shards ? 1 : 0);
+      s->frames.resize(frames);
+      for (frame& f : s->frames)
+      {
+        f.owner = s;
+        f.data = _slab.get() + _pageSize * next++;
+        f.index = INVALID_INDEX;
+        f.length = 0;
+        f.pins = 0;
+        f.referenced = false;
+        f.status = state::EMPTY;
+      }
+
+      _shards.emplace_back(s);
+    }
+  }
+
+  page_cache(const page_cache&) = delete;
+  page_cache& operator=(const page_cache&) = delete;
+
+  /* returns the page pinned, loading it if required, empty page if outside source */
+  page get(size_t index)
+  {
+    if (index >= _pageCount)
+      return page();
+
+    return page(this, acquire(index, true));
+  }
+
+  /* loads the page without pinning it, never blocks on other threads, returns false
+     if the page was already present or being loaded or if every frame is pinned */
+  bool prefetch(size_t index)
+  {
+    if (index >= _pageCount)
+      return false;
+
+    frame* f = acquire(index, false);
+
+    if (f)
+      unpin(f);
+
+    return f != nullptr;
+  }
+
+  bool contains(size_t index)
+  {
+    shard& s = shardFor(index);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.mapping.find(index) != s.mapping.end();
+  }
+
+  statistics stats() const { return { _hits.load(), _misses.load(), _evictions.load(), _prefetches.load() }; }
+
+  size_t pageSize() const { return _pageSize; }
+  size_t pageCount() const { return _pageCount; }
+  size_t capacity() const { return _maxPages; }
+  size_t size() const { return _length; }
+  size_t sizeInMemory() const { return _resident * _pageSize; }
+};
+
+/* loads pages of a page_cache on a background I/O thread, requests for pages which
+   are already cached or queued are dropped as are requests exceeding the queue depth,
+   so hints never block the caller nor evict more than the depth worth of pages */
+class page_prefetcher
+{
+private:
+  page_cache* _cache;
+  size_t _depth;
+
+  std::mutex _mutex;
+  std::unordered_set<size_t> _pending;
+  std::atomic<bool> _stopping;
+
+  std::unique_ptr<thread_pool> _pool;
+
+public:
+  page_prefetcher(page_cache* cache, size_t depth, size_t threads = 1) :
+  _cache(cache), _depth(depth), _stopping(false), _pool(new thread_pool(threads)) { }
+
+  ~page_prefetcher()
+  {
+    /* queued requests are skipped, only the ones being loaded are waited for */
+    _stopping = true;
+    _pool.reset();
+  }
+
+  page_prefetcher(const page_prefetcher&) = delete;
+  page_prefetcher& operator=(const page_prefetcher&) = delete;
+
+  bool request(size_t index)
+  {
+    if (index >= _cache->pageCount() || _cache->contains(index))
+      return false;
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if (_pending.size() >= _depth || !_pending.insert(index).second)
+        return false;
+    }
+
+    _pool->submit([this, index] () {
+      try
+      {
+        if (!_stopping)
+          _cache->prefetch(index);
+      }
+      catch (...)
+      {
+        /* a failing page will be reported by the demand read */
+      }
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      _pending.erase(index);
+    });
+
+    return true;
+  }
+
+  void request(size_t first, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+      request(first + i);
+  }
+
+  /* blocks until every queued request has been served */
+  void wait() { _pool->wait(); }
+
+  size_t depth() const { return _depth; }
+};
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "zlib_filter.h"
+
+#include <deque>
+#include <vector>
+
+/* deflate compressor which splits input in fixed size blocks and compresses them
+   concurrently, each block is primed with the last 32KB of the preceding one and
+   terminated with a sync flush so that the concatenation is a single valid deflate
+   stream, checksums are computed per block and combined in order */
+class parallel_deflate_filter : public data_filter
+{
+private:
+  static constexpr size_t DICTIONARY_SIZE = KB32;
+
+  using block_data = std::shared_ptr<std::vector<byte>>;
+
+  struct block_job
+  {
+    block_data input;
+    block_data dictionary;
+    std::vector<byte> output;
+    u32 check;
+    bool last;
+    std::future<void> done;
+  };
+
+  zlib_format _format;
+  int _level;
+  size_t _maxInFlight;
+  std::unique_ptr<thread_pool> _pool;
+
+  std::deque<std::unique_ptr<block_job>> _jobs;
+  block_data _previous;
+
+  std::vector<byte> _staged;
+  size_t _stagedOffset;
+
+  u32 _check;
+  size_t _totalIn;
+  bool _headerStaged;
+  bool _lastSubmitted;
+  bool _trailerStaged;
+
+  static u32 initialCheck(zlib_format format) { return format == zlib_format::ZLIB ? adler32(0, Z_NULL, 0) : crc32(0, Z_NULL, 0); }
+
+  static void compress(block_job* job, zlib_format format, int level)
+  {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw exceptions::messaged_exception("parallel_deflate_filter: init failed");
+
+    if (job->dictionary && !job->dictionary->empty())
+    {
+      const std::vector<byte>& dictionary = *job->dictionary;
+      size_t length = std::min(DICTIONARY_SIZE, dictionary.size());
+      deflateSetDictionary(&stream, dictionary.data() + dictionary.size() - length, static_cast<uInt>(length));
+    }
+
+    const std::vector<byte>& input = *job->input;
+    std::vector<byte>& output = job->output;
+
+    /* sync flush may add up to a few bytes over the bound */
+    output.resize(deflateBound(&stream, input.size()) + 16);
+
+    stream.next_in = const_cast<byte*>(input.data());
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = output.data();
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    const int flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+    int r;
+
+    for (;;)
+    {
+      r = ::deflate(&stream, flush);
+
+      if (r == Z_STREAM_ERROR)
+        break;
+      else if (r == Z_STREAM_END || (flush == Z_SYNC_FLUSH && stream.avail_in == 0 && stream.avail_out != 0))
+        break;
+
+      size_t produced = output.size() - stream.avail_out;
+      output.resize(output.size() * 2);
+      stream.next_out = output.data() + produced;
+      stream.avail_out = static_cast<uInt>(output.size() - produced);
+    }
+
+    output.resize(output.size() - stream.avail_out);
+    deflateEnd(&stream);
+
+    if (r == Z_STREAM_ERROR)
+      throw exceptions::messaged_exception("parallel_deflate_filter: stream error");
+
+    if (format == zlib_format::ZLIB)
+      job->check = adler32(adler32(0, Z_NULL, 0), input.data(), static_cast<uInt>(input.size()));
+    else
+      job->check = crc32(crc32(0, Z_NULL, 0), input.data(), static_cast<uInt>(input.size()));
+  }
+
+  void stageHeader()
+  {
+    if (_format == zlib_format::GZIP)
+    {
+      const byte xfl = _level == 9 ? 2 : (_level == 1 ? 4 : 0);
+      _staged.insert(_staged.end(), { 0x1f, 0x8b, Z_DEFLATED, 0x00, 0x00, 0x00, 0x00, 0x00, xfl, 0x03 });
+    }
+    else if (_format == zlib_format::ZLIB)
+    {
+      const byte cmf = 0x78;
+      byte flg = (_level == 1 ? 0 : (_level >= 2 && _level <= 5 ? 1 : (_level == 9 ? 3 : 2))) << 6;
+      flg += 31 - ((cmf * 256 + flg) % 31);
+      _staged.insert(_staged.end(), { cmf, flg });
+    }
+  }
+
+  void stageTrailer()
+  {
+    if (_format == zlib_format::GZIP)
+    {
+      const u32 length = static_cast<u32>(_totalIn);
+      for (u32 value : { _check, length })
+        for (size_t i = 0; i < 4; ++i)
+          _staged.push_back((value >> (i*8)) & 0xFF);
+    }
+    else if (_format == zlib_format::ZLIB)
+    {
+      for (size_t i = 0; i < 4; ++i)
+        _staged.push_back((_check >> ((3-i)*8)) & 0xFF);
+    }
+  }
+
+  void drainStaged()
+  {
+    size_t effective = std::min(_out.available(), _staged.size() - _stagedOffset);
+    std::copy(_staged.begin() + _stagedOffset, _staged.begin() + _stagedOffset + effective, _out.tail());
+    _out.advance(effective);
+    _stagedOffset += effective;
+
+    if (_stagedOffset == _staged.size())
+    {
+      _staged.clear();
+      _stagedOffset = 0;
+    }
+  }
+
+  void submitBlock()
+  {
+    std::unique_ptr<block_job> job(new block_job());
+    job->input = std::make_shared<std::vector<byte>>(_in.head(), _in.head() + _in.used());
+    job->dictionary = _previous;
+    job->check = 0;
+    job->last = ended();
+
+    _totalIn += _in.used();
+    _in.consume(_in.used());
+    _previous = job->input;
+    _lastSubmitted = job->last;
+
+    block_job* raw = job.get();
+    const zlib_format format = _format;
+    const int level = _level;
+    job->done = _pool->submit([raw, format, level] () { compress(raw, format, level); });
+
+    _jobs.push_back(std::move(job));
+  }
+
+  bool emitBlock(bool wait)
+  {
+    block_job* job = _jobs.front().get();
+
+    if (!wait && job->done.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return false;
+
+    /* rethrows any exception raised by the worker */
+    job->done.get();
+
+    _check = _format == zlib_format::ZLIB ?
+      adler32_combine(_check, job->check, job->input->size()) :
+      crc32_combine(_check, job->check, job->input->size());
+
+    _staged.insert(_staged.end(), job->output.begin(), job->output.end());
+
+    if (job->last)
+    {
+      stageTrailer();
+      _trailerStaged = true;
+    }
+
+    _jobs.pop_front();
+    return true;
+  }
+
+public:
+  parallel_deflate_filter(zlib_format format = zlib_format::GZIP, int level = Z_DEFAULT_COMPRESSION, size_t blockSize = KB128, size_t threads = thread_pool::defaultConcurrency()) :
+  data_filter(blockSize, blockSize), _format(format), _level(level), _maxInFlight(threads * 2), _pool(new thread_pool(threads)),
+  _stagedOffset(0), _check(0), _totalIn(0), _headerStaged(false), _lastSubmitted(false), _trailerStaged(false)
+  {
+    assert(format != zlib_format::AUTO);
+    assert(blockSize >= DICTIONARY_SIZE);
+  }
+
+  ~parallel_deflate_filter()
+  {
+    /* workers reference jobs so they must complete before these are released */
+    _pool.reset();
+  }
+
+  /* resets every per stream state so the filter can be reused, blocks of a previous stream are dropped */
+  void init() override
+  {
+    finalize();
+
+    _previous.reset();
+    _staged.clear();
+    _stagedOffset = 0;
+
+    _check = initialCheck(_format);
+    _totalIn = 0;
+    _headerStaged = false;
+    _lastSubmitted = false;
+    _trailerStaged = false;
+  }
+
+  void process() override
+  {
+    if (!_headerStaged)
+    {
+      stageHeader();
+      _headerStaged = true;
+    }
+
+    drainStaged();
+
+    /* move completed blocks to output in order, blocking only when no other progress is possible */
+    while (_staged.empty() && !_jobs.empty())
+    {
+      bool wait = _jobs.size() >= _maxInFlight || (ended() && _lastSubmitted);
+      if (!emitBlock(wait))
+        break;
+      drainStaged();
+    }
+
+    if (!_lastSubmitted && (_in.full() || ended()) && _jobs.size() < _maxInFlight)
+      submitBlock();
+
+    if (_trailerStaged && _staged.empty())
+      markFinished();
+  }
+
+  void finalize() override
+  {
+    while (!_jobs.empty())
+    {
+      _jobs.front()->done.wait();
+      _jobs.pop_front();
+    }
+  }
+
+  u32 checksum() const { return _check; }
+  size_t totalIn() const { return _totalIn; }
+
+  std::string name() override { return "parallel_deflate"; }
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+#include "buffer_pool.h"
+
+/* multiple_data_source which reads the next ahead sources on background threads while the current one
+   is consumed, budget is shared by them and the current one, each source gets at most its share and
+   never more than a pooled block or what is left of it when it's seekable, remaining data is read
+   directly once reached, callbacks keep firing in order on the reading thread but onBegin is called
+   after a source has already been read from */
+class prefetching_data_source : public multiple_data_source
+{
+private:
+  /* data read ahead from a source by a worker, valid once its future is ready */
+  struct prefetched
+  {
+    byte* data;
+    size_t capacity;
+    size_t length;
+    size_t position;
+    bool ended;
+  };
+
+  std::function<void(data_source*)> _onPrefetch;
+
+  size_t _ahead;
+  size_t _slotSize;
+  size_t _scheduled;
+  std::vector<prefetched> _prefetched;
+  std::vector<std::future<void>> _pending;
+  std::unique_ptr<thread_pool> _pool;
+
+  void prefetch(size_t index)
+  {
+    prefetched& slot = _prefetched[index];
+    data_source* source = sources()[index];
+
+    _onPrefetch(source);
+
+    slot.capacity = _slotSize;
+
+    /* small sources don't need a whole slot, unknown or empty lengths keep it */
+    if (source->isSeekable())
+    {
+      const seekable_data_source* seekable = static_cast<const seekable_data_source*>(source);
+      const size_t left = seekable->size() > size_t(seekable->tell()) ? seekable->size() - seekable->tell() : 0;
+
+      if (left)
+        slot.capacity = std::min(slot.capacity, left);
+    }
+
+    slot.data = buffer_pool::instance().allocate(slot.capacity);
+
+    while (slot.length < slot.capacity)
+    {
+      size_t effective = source->read(slot.data + slot.length, slot.capacity - slot.length);
+
+      if (effective == END_OF_STREAM)
+      {
+        slot.ended = true;
+        break;
+      }
+      else if (effective == 0)
+        break;
+
+      slot.length += effective;
+    }
+  }
+
+  void release(prefetched& slot)
+  {
+    if (slot.data)
+    {
+      buffer_pool::instance().release(slot.data, slot.capacity);
+      slot.data = nullptr;
+    }
+  }
+
+  /* keeps the sources following current one being prefetched */
+  void schedule(size_t current)
+  {
+    while (_scheduled < _prefetched.size() && _scheduled <= current + _ahead)
+    {
+      size_t index = _scheduled++;
+      _pending[index] = _pool->submit([this, index] () { prefetch(index); });
+    }
+  }
+
+protected:
+  size_t readCurrent(byte* dest, size_t amount) override
+  {
+    size_t index = current();
+    schedule(index);
+
+    /* rethrows failures of the worker */
+    if (_pending[index].valid())
+      _pending[index].get();
+
+    prefetched& slot = _prefetched[index];
+
+    if (slot.position < slot.length)
+    {
+      size_t effective = std::min(amount, slot.length - slot.position);
+      memcpy(dest, slot.data + slot.position, effective);
+      slot.position += effective;
+      return effective;
+    }
+
+    release(slot);
+    return slot.ended ? END_OF_STREAM : sources()[index]->read(dest, amount);
+  }
+
+public:
+  /* a slot is budget / (ahead + 1) bytes capped to the largest pooled block */
+  prefetching_data_source(const std::vector<data_source*>& sources, size_t ahead, size_t budget = MB64, size_t threads = 0) :
+  multiple_data_source(sources), _onPrefetch([](data_source*){}), _ahead(std::max(ahead, size_t(1))),
+  _slotSize(std::min(std::max(size_t(1), budget / (_ahead + 1)), size_t(buffer_pool::MAX_CLASS_SIZE))), _scheduled(0),
+  _prefetched(sources.size(), { nullptr, 0, 0, 0, false }), _pending(sources.size()),
+  _pool(new thread_pool(threads ? threads : _ahead)) { }
+
+  ~prefetching_data_source()
+  {
+    _pool.reset();
+
+    for (prefetched& slot : _prefetched)
+      release(slot);
+  }
+
+  /* called on a worker thread before a source is first read, meant to open lazily opened sources,
+     must be set before the first read */
+  void setOnPrefetch(std::function<void(data_source*)> onPrefetch)
+  {
+    assert(!started());
+    this->_onPrefetch = onPrefetch;
+  }
+};
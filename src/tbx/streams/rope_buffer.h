@@ -0,0 +1,215 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "data_source.h"
+#include "buffer_pool.h"
+
+#include <vector>
+
+/* append only buffer made of a chain of pooled chunks, growing never moves existing data,
+   writes always append regardless of current position which is used only for reading,
+   splicing moves chunks from another rope without copying so chunks can be partially filled */
+class rope_buffer : public seekable_data_source, public data_sink
+{
+private:
+  struct chunk
+  {
+    byte* data;
+    size_t capacity;
+    size_t length;
+    size_t offset;
+  };
+
+  std::vector<chunk> _chunks;
+  size_t _chunkSize;
+  size_t _size;
+
+  roff_t _position;
+  size_t _cursor;
+
+  void release()
+  {
+    for (const chunk& c : _chunks)
+      buffer_pool::instance().release(c.data, c.capacity);
+    _chunks.clear();
+  }
+
+  /* index of the chunk containing offset, offset must be less than size */
+  size_t find(size_t offset) const
+  {
+    auto it = std::upper_bound(_chunks.begin(), _chunks.end(), offset, [] (size_t offset, const chunk& c) { return offset < c.offset; });
+    return std::distance(_chunks.begin(), it) - 1;
+  }
+
+public:
+  rope_buffer(size_t chunkSize = KB64) : _chunkSize(chunkSize), _size(0), _position(0), _cursor(0)
+  {
+    assert(chunkSize > 0);
+  }
+
+  rope_buffer(rope_buffer&& other) : _chunks(std::move(other._chunks)), _chunkSize(other._chunkSize), _size(other._size), _position(other._position), _cursor(0)
+  {
+    other._chunks.clear();
+    other._size = 0;
+    other._position = 0;
+  }
+
+  rope_buffer& operator=(rope_buffer&& other)
+  {
+    release();
+
+    _chunks = std::move(other._chunks);
+    _chunkSize = other._chunkSize;
+    _size = other._size;
+    _position = other._position;
+    _cursor = 0;
+
+    other._chunks.clear();
+    other._size = 0;
+    other._position = 0;
+
+    return *this;
+  }
+
+  rope_buffer(const rope_buffer&) = delete;
+  rope_buffer& operator=(const rope_buffer&) = delete;
+
+  ~rope_buffer() { release(); }
+
+  void append(const byte* data, size_t amount)
+  {
+    while (amount > 0)
+    {
+      if (_chunks.empty() || _chunks.back().length == _chunks.back().capacity)
+        _chunks.push_back({ buffer_pool::instance().allocate(_chunkSize), _chunkSize, 0, _size });
+
+      chunk& last = _chunks.back();
+      size_t effective = std::min(amount, last.capacity - last.length);
+
+      memcpy(last.data + last.length, data, effective);
+      last.length += effective;
+      _size += effective;
+
+      data += effective;
+      amount -= effective;
+    }
+  }
+
+  /* moves every chunk of other at the end of this rope without copying data, other is left empty */
+  void splice(rope_buffer& other)
+  {
+    if (&other == this)
+      return;
+
+    _chunks.reserve(_chunks.size() + other._chunks.size());
+
+    for (chunk& c : other._chunks)
+    {
+      c.offset = _size;
+      _size += c.length;
+      _chunks.push_back(c);
+    }
+
+    other._chunks.clear();
+    other._size = 0;
+    other._position = 0;
+    other._cursor = 0;
+  }
+
+  /* merges chunks into a single contiguous one if needed and returns it, later appends
+     start a new chunk so the returned pointer stays valid until the rope is modified */
+  const byte* linearize()
+  {
+    if (_chunks.empty())
+      return nullptr;
+    else if (_chunks.size() == 1)
+      return _chunks.front().data;
+
+    byte* data = buffer_pool::instance().allocate(_size);
+    for (const chunk& c : _chunks)
+      memcpy(data + c.offset, c.data, c.length);
+
+    release();
+    _chunks.push_back({ data, _size, _size, 0 });
+    _cursor = 0;
+
+    return data;
+  }
+
+  void clear()
+  {
+    release();
+    _size = 0;
+    _position = 0;
+    _cursor = 0;
+  }
+
+  /* writes the whole content with a single gather write */
+  bool serialize(const file_handle& file) const
+  {
+    std::vector<io_vector> parts;
+    parts.reserve(_chunks.size());
+
+    for (const chunk& c : _chunks)
+      parts.push_back({ c.data, c.length });
+
+    return file.write(parts.data(), parts.size()) == _size;
+  }
+
+  size_t write(const byte* data, size_t amount) override
+  {
+    if (amount == END_OF_STREAM)
+      return END_OF_STREAM;
+
+    append(data, amount);
+    return amount;
+  }
+
+  size_t readAt(roff_t offset, byte* dest, size_t amount) override
+  {
+    if (offset < 0 || size_t(offset) >= _size)
+      return END_OF_STREAM;
+
+    const chunk& c = _chunks[find(offset)];
+    size_t positionInChunk = offset - c.offset;
+    size_t effective = std::min(amount, c.length - positionInChunk);
+
+    memcpy(dest, c.data + positionInChunk, effective);
+    return effective;
+  }
+
+  /* sequential reads walk the chain from the last chunk read instead of searching it */
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (size_t(_position) >= _size)
+      return END_OF_STREAM;
+
+    if (_cursor >= _chunks.size() || size_t(_position) < _chunks[_cursor].offset)
+      _cursor = find(_position);
+
+    size_t done = 0;
+    while (done < amount && size_t(_position) < _size)
+    {
+      while (size_t(_position) >= _chunks[_cursor].offset + _chunks[_cursor].length)
+        ++_cursor;
+
+      const chunk& c = _chunks[_cursor];
+      size_t positionInChunk = _position - c.offset;
+      size_t effective = std::min(amount - done, c.length - positionInChunk);
+
+      memcpy(dest + done, c.data + positionInChunk, effective);
+      done += effective;
+      _position += effective;
+    }
+
+    return done;
+  }
+
+  void seek(roff_t position) override { _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _size; }
+
+  bool empty() const { return _size == 0; }
+  size_t chunkCount() const { return _chunks.size(); }
+  size_t chunkSize() const { return _chunkSize; }
+};
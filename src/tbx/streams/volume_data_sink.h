@@ -0,0 +1,284 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+#include "buffer_pool.h"
+
+#include <exception>
+
+/* splits a stream into volumes of fixed sizes, each one written by its own worker through
+   positional writes, volume ranges are assigned up front so a volume is opened and its space
+   preallocated as soon as the stream reaches it while previous ones are still being flushed,
+   volumes are trimmed to the data they received, data beyond the total size of volumes
+   is refused, split() writes every volume concurrently reading from a seekable source */
+class parallel_volume_sink : public data_sink
+{
+public:
+  using path_factory = std::function<path(size_t)>;
+
+private:
+  /* offset is relative to the volume */
+  struct block
+  {
+    byte* data;
+    size_t length;
+    u64 offset;
+  };
+
+  using block_queue = bounded_queue<block>;
+
+  struct volume
+  {
+    path file;
+    u64 start;
+    size_t size;
+    size_t written;
+    std::unique_ptr<block_queue> queue;
+  };
+
+  std::vector<volume> _volumes;
+  std::unique_ptr<thread_pool> _pool;
+
+  size_t _blockSize;
+  size_t _queueDepth;
+  size_t _threads;
+
+  size_t _current;
+  u64 _position;
+  block _block;
+  bool _closed;
+
+  std::mutex _errorMutex;
+  std::exception_ptr _error;
+
+  void fail()
+  {
+    std::lock_guard<std::mutex> lock(_errorMutex);
+    if (!_error)
+      _error = std::current_exception();
+  }
+
+  void checkError()
+  {
+    std::lock_guard<std::mutex> lock(_errorMutex);
+    if (_error)
+      std::rethrow_exception(_error);
+  }
+
+  bool failed()
+  {
+    std::lock_guard<std::mutex> lock(_errorMutex);
+    return _error != nullptr;
+  }
+
+  static file_handle open(const volume& v)
+  {
+    file_handle handle(v.file, file_mode::WRITING);
+
+    if (!handle)
+      throw exceptions::messaged_exception(fmt::sprintf("parallel_volume_sink: unable to open %s", v.file.c_str()));
+
+    /* best effort, volume is written anyway if space can't be reserved */
+    handle.preallocate(v.size);
+    return handle;
+  }
+
+  static void finish(const file_handle& handle, const volume& v)
+  {
+    if (!handle.truncate(v.written))
+      throw exceptions::messaged_exception(fmt::sprintf("parallel_volume_sink: unable to trim %s", v.file.c_str()));
+  }
+
+  void runVolume(volume& v)
+  {
+    block b;
+
+    try
+    {
+      file_handle handle = open(v);
+
+      while (v.queue->pop(b))
+      {
+        bool success = handle.writeAt(b.data, b.length, b.offset) == b.length;
+        buffer_pool::instance().release(b.data, _blockSize);
+
+        if (!success)
+          throw exceptions::messaged_exception(fmt::sprintf("parallel_volume_sink: write failed on %s", v.file.c_str()));
+
+        v.written = b.offset + b.length;
+      }
+
+      finish(handle, v);
+    }
+    catch (...)
+    {
+      fail();
+
+      /* keep consuming so that the writer never blocks on a dead volume */
+      while (v.queue->pop(b))
+        buffer_pool::instance().release(b.data, _blockSize);
+    }
+  }
+
+  void pool()
+  {
+    if (!_pool)
+      _pool.reset(new thread_pool(std::min(_threads, _volumes.size())));
+  }
+
+  void publish(bool last)
+  {
+    volume& v = _volumes[_current];
+
+    if (_block.length)
+      v.queue->push(std::move(_block));
+    else if (_block.data)
+      buffer_pool::instance().release(_block.data, _blockSize);
+
+    _block = { nullptr, 0, 0 };
+
+    if (last)
+    {
+      v.queue->close();
+      ++_current;
+    }
+  }
+
+  void close()
+  {
+    if (_closed)
+      return;
+
+    _closed = true;
+
+    if (_current < _volumes.size() && _volumes[_current].queue)
+      publish(true);
+
+    _pool.reset();
+  }
+
+public:
+  parallel_volume_sink(path_factory factory, const std::vector<size_t>& sizes, size_t threads = 0, size_t blockSize = MB1, size_t queueDepth = 8) :
+  _blockSize(blockSize), _queueDepth(queueDepth), _threads(threads ? threads : thread_pool::defaultConcurrency()),
+  _current(0), _position(0), _block({ nullptr, 0, 0 }), _closed(false)
+  {
+    assert(!sizes.empty() && blockSize > 0 && queueDepth > 0);
+
+    u64 start = 0;
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+      assert(sizes[i] > 0);
+      _volumes.push_back({ factory(i), start, sizes[i], 0, nullptr });
+      start += sizes[i];
+    }
+  }
+
+  parallel_volume_sink(const parallel_volume_sink&) = delete;
+  parallel_volume_sink& operator=(const parallel_volume_sink&) = delete;
+
+  ~parallel_volume_sink() { close(); }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (_closed)
+      return END_OF_STREAM;
+
+    if (amount == END_OF_STREAM)
+    {
+      close();
+      TRACE_P("%p: parallel_volume_sink::write() EOS -> closed", this);
+
+      checkError();
+      return END_OF_STREAM;
+    }
+
+    checkError();
+    pool();
+
+    size_t done = 0;
+    while (done < amount && _current < _volumes.size())
+    {
+      volume& v = _volumes[_current];
+
+      /* first data for this volume, its worker is started */
+      if (!v.queue)
+      {
+        v.queue.reset(new block_queue(_queueDepth));
+        _pool->submit([this, &v] () { runVolume(v); });
+      }
+
+      if (!_block.data)
+        _block = { buffer_pool::instance().allocate(_blockSize), 0, _position - v.start };
+
+      const u64 end = v.start + v.size;
+      size_t effective = std::min({ amount - done, _blockSize - _block.length, size_t(end - _position) });
+
+      memcpy(_block.data + _block.length, src + done, effective);
+      _block.length += effective;
+      _position += effective;
+      done += effective;
+
+      if (_position == end || _block.length == _blockSize)
+        publish(_position == end);
+    }
+
+    return done || amount == 0 ? done : END_OF_STREAM;
+  }
+
+  /* writes source into the volumes with every volume read and written concurrently, source
+     must support concurrent readAt(), returns bytes written and can't be mixed with write() */
+  size_t split(seekable_data_source* source)
+  {
+    assert(_position == 0 && !_closed);
+
+    const u64 length = source->size();
+    pool();
+
+    for (volume& v : _volumes)
+    {
+      if (v.start >= length)
+        break;
+
+      _pool->submit([this, &v, source, length] () {
+        byte* buffer = buffer_pool::instance().allocate(_blockSize);
+
+        try
+        {
+          file_handle handle = open(v);
+          const size_t total = std::min(u64(v.size), length - v.start);
+
+          while (v.written < total && !failed())
+          {
+            size_t effective = source->readAt(v.start + v.written, buffer, std::min(_blockSize, total - v.written));
+
+            if (effective == END_OF_STREAM || effective == 0 || handle.writeAt(buffer, effective, v.written) != effective)
+              throw exceptions::messaged_exception(fmt::sprintf("parallel_volume_sink: unable to split into %s", v.file.c_str()));
+
+            v.written += effective;
+          }
+
+          finish(handle, v);
+        }
+        catch (...)
+        {
+          fail();
+        }
+
+        buffer_pool::instance().release(buffer, _blockSize);
+      });
+    }
+
+    _closed = true;
+    _pool.reset();
+    _position = std::min(length, _volumes.back().start + _volumes.back().size);
+
+    checkError();
+    return _position;
+  }
+
+  size_t count() const { return _volumes.size(); }
+  const path& volumePath(size_t index) const { return _volumes[index].file; }
+  /* bytes stored in a volume, valid once the sink has been closed */
+  size_t written(size_t index) const { return _volumes[index].written; }
+};
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_source.h"
+#include "xz_filter.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+/* random access reader for .xz files, the stream index is parsed from the end of the
+   file and blocks are decoded independently on a thread pool, sequential reads
+   schedule the following blocks ahead of time while random reads only decode the
+   blocks which cover the requested range, files produced by single threaded
+   encoders are usually made of a single block and won't benefit from this */
+class xz_data_source : public seekable_data_source
+{
+private:
+  struct block_info
+  {
+    u64 compressedOffset;
+    u64 totalSize;
+    u64 unpaddedSize;
+    u64 uncompressedOffset;
+    u64 uncompressedSize;
+    lzma_check check;
+  };
+
+  using block_ptr = std::shared_ptr<const std::vector<byte>>;
+
+  seekable_data_source* _source;
+  std::mutex _sourceMutex;
+
+  std::vector<block_info> _blocks;
+  u64 _length;
+  roff_t _position;
+
+  size_t _readAhead;
+  size_t _maxCachedBlocks;
+  size_t _lastBlock;
+
+  std::map<size_t, std::shared_future<block_ptr>> _cache;
+  std::unique_ptr<thread_pool> _pool;
+
+  [[noreturn]] static void error(const char* message) { throw exceptions::file_format_error(fmt::sprintf("xz_data_source: %s", message)); }
+
+  void readFully(roff_t offset, byte* dest, size_t length)
+  {
+    std::lock_guard<std::mutex> lock(_sourceMutex);
+    _source->seek(offset);
+
+    size_t done = 0;
+    while (done < length)
+    {
+      size_t effective = _source->read(dest + done, length - done);
+      if (effective == END_OF_STREAM || effective == 0)
+        error("unexpected end of file");
+      done += effective;
+    }
+  }
+
+  void parseIndex()
+  {
+    lzma_index* combined = nullptr;
+    roff_t position = _source->size();
+
+    if (position == 0)
+      error("file is too small");
+    else if (position % 4 != 0)
+      error("file size is not a multiple of four");
+
+    while (position > 0)
+    {
+      byte buffer[LZMA_STREAM_HEADER_SIZE];
+      lzma_stream_flags footerFlags, headerFlags;
+
+      /* skip stream padding */
+      lzma_vli padding = 0;
+      for (;;)
+      {
+        if (position < 2*LZMA_STREAM_HEADER_SIZE)
+          error("file is too small");
+
+        readFully(position - LZMA_STREAM_HEADER_SIZE, buffer, LZMA_STREAM_HEADER_SIZE);
+        if (hidden::readLE32(buffer + 8) != 0)
+          break;
+
+        padding += 4;
+        position -= 4;
+      }
+
+      position -= LZMA_STREAM_HEADER_SIZE;
+      if (lzma_stream_footer_decode(&footerFlags, buffer) != LZMA_OK)
+        error("invalid stream footer");
+
+      if (footerFlags.backward_size > u64(position))
+        error("invalid index size");
+      position -= footerFlags.backward_size;
+
+      std::vector<byte> indexData(footerFlags.backward_size);
+      readFully(position, indexData.data(), indexData.size());
+
+      lzma_index* index = nullptr;
+      u64 memlimit = UINT64_MAX;
+      size_t indexPosition = 0;
+      if (lzma_index_buffer_decode(&index, &memlimit, nullptr, indexData.data(), &indexPosition, indexData.size()) != LZMA_OK)
+        error("invalid stream index");
+
+      const lzma_vli blocksSize = lzma_index_total_size(index);
+      if (blocksSize + LZMA_STREAM_HEADER_SIZE > u64(position))
+      {
+        lzma_index_end(index, nullptr);
+        error("invalid stream index");
+      }
+      position -= blocksSize + LZMA_STREAM_HEADER_SIZE;
+
+      readFully(position, buffer, LZMA_STREAM_HEADER_SIZE);
+      if (lzma_stream_header_decode(&headerFlags, buffer) != LZMA_OK || lzma_stream_flags_compare(&headerFlags, &footerFlags) != LZMA_OK)
+      {
+        lzma_index_end(index, nullptr);
+        error("stream header doesn't match footer");
+      }
+
+      if (lzma_index_stream_flags(index, &footerFlags) != LZMA_OK || lzma_index_stream_padding(index, padding) != LZMA_OK)
+      {
+        lzma_index_end(index, nullptr);
+        error("invalid stream flags");
+      }
+
+      /* streams are found backwards so the combined index is appended to the current one */
+      if (combined && lzma_index_cat(index, combined, nullptr) != LZMA_OK)
+      {
+        lzma_index_end(index, nullptr);
+        lzma_index_end(combined, nullptr);
+        error("unable to combine stream indices");
+      }
+
+      combined = index;
+    }
+
+    if (!combined)
+      error("file is too small");
+
+    lzma_index_iter it;
+    lzma_index_iter_init(&it, combined);
+    while (!lzma_index_iter_next(&it, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+    {
+      _blocks.push_back({
+        it.block.compressed_file_offset,
+        it.block.total_size,
+        it.block.unpadded_size,
+        it.block.uncompressed_file_offset,
+        it.block.uncompressed_size,
+        it.stream.flags->check
+      });
+    }
+
+    _length = lzma_index_uncompressed_size(combined);
+    lzma_index_end(combined, nullptr);
+  }
+
+  block_ptr decodeBlock(size_t index)
+  {
+    const block_info& info = _blocks[index];
+
+    std::vector<byte> input(info.totalSize);
+    readFully(info.compressedOffset, input.data(), input.size());
+
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    memset(&block, 0, sizeof(block));
+    block.version = 0;
+    block.check = info.check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(input[0]);
+
+    if (block.header_size > input.size() || lzma_block_header_decode(&block, nullptr, input.data()) != LZMA_OK)
+      error("invalid block header");
+
+    std::shared_ptr<std::vector<byte>> output = std::make_shared<std::vector<byte>>(info.uncompressedSize);
+    lzma_stream stream = LZMA_STREAM_INIT;
+
+    lzma_ret r = lzma_block_compressed_size(&block, info.unpaddedSize);
+    if (r == LZMA_OK)
+      r = lzma_block_decoder(&stream, &block);
+
+    /* filter options are allocated by the header decoder and copied by the block decoder */
+    for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+      free(filters[i].options);
+
+    if (r != LZMA_OK)
+      error(hidden::lzmaErrorMessage(r));
+
+    stream.next_in = input.data() + block.header_size;
+    stream.avail_in = input.size() - block.header_size;
+    stream.next_out = output->data();
+    stream.avail_out = output->size();
+
+    r = lzma_code(&stream, LZMA_FINISH);
+    lzma_end(&stream);
+
+    if (r != LZMA_STREAM_END || stream.avail_out != 0)
+      error(r == LZMA_STREAM_END ? "block size mismatch" : hidden::lzmaErrorMessage(r));
+
+    TRACE_P("%p: xz_data_source::decodeBlock(%lu) %lu -> %lu", this, index, info.totalSize, info.uncompressedSize);
+
+    return output;
+  }
+
+  std::shared_future<block_ptr>& schedule(size_t index)
+  {
+    auto it = _cache.find(index);
+
+    if (it == _cache.end())
+      it = _cache.emplace(index, _pool->submit([this, index] () { return decodeBlock(index); }).share()).first;
+
+    return it->second;
+  }
+
+  void evict(size_t current)
+  {
+    /* drop blocks behind the current one first, then the farthest ahead */
+    while (_cache.size() > _maxCachedBlocks)
+    {
+      auto first = _cache.begin();
+      auto last = std::prev(_cache.end());
+
+      auto victim = first->first < current ? first : last;
+      if (victim->first == current)
+        break;
+
+      _cache.erase(victim);
+    }
+  }
+
+  size_t findBlock(roff_t position) const
+  {
+    auto it = std::upper_bound(_blocks.begin(), _blocks.end(), u64(position), [] (u64 offset, const block_info& block) { return offset < block.uncompressedOffset; });
+    return std::distance(_blocks.begin(), it) - 1;
+  }
+
+public:
+  xz_data_source(seekable_data_source* source, size_t threads = thread_pool::defaultConcurrency(), size_t readAhead = 0, size_t maxCachedBlocks = 0) :
+  _source(source), _length(0), _position(0), _readAhead(readAhead ? readAhead : threads), _lastBlock(END_OF_STREAM),
+  _pool(new thread_pool(threads))
+  {
+    _maxCachedBlocks = maxCachedBlocks ? maxCachedBlocks : _readAhead + 2;
+    parseIndex();
+  }
+
+  ~xz_data_source()
+  {
+    /* pending decodes reference this instance */
+    _pool.reset();
+  }
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (u64(_position) >= _length)
+      return END_OF_STREAM;
+
+    const size_t index = findBlock(_position);
+    const block_info& info = _blocks[index];
+
+    const bool sequential = _lastBlock == index || _lastBlock + 1 == index;
+    _lastBlock = index;
+
+    block_ptr block = schedule(index).get();
+
+    if (sequential)
+      for (size_t i = index + 1; i < _blocks.size() && i <= index + _readAhead; ++i)
+        schedule(i);
+
+    evict(index);
+
+    size_t offset = _position - info.uncompressedOffset;
+    size_t effective = std::min(amount, block->size() - offset);
+    std::copy(block->data() + offset, block->data() + offset + effective, dest);
+    _position += effective;
+
+    return effective;
+  }
+
+  void seek(roff_t position) override { _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _length; }
+
+  size_t blockCount() const { return _blocks.size(); }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/thread_pool.h"
+#include "data_filter.h"
+
+#include <lzma.h>
+
+namespace hidden
+{
+  inline const char* lzmaErrorMessage(lzma_ret r)
+  {
+    switch (r)
+    {
+      case LZMA_MEM_ERROR: return "out of memory";
+      case LZMA_MEMLIMIT_ERROR: return "memory usage limit reached";
+      case LZMA_FORMAT_ERROR: return "file format not recognized";
+      case LZMA_OPTIONS_ERROR: return "unsupported options";
+      case LZMA_DATA_ERROR: return "compressed data is corrupt";
+      case LZMA_BUF_ERROR: return "unexpected end of stream";
+      case LZMA_UNSUPPORTED_CHECK: return "unsupported integrity check";
+      default: return "internal error";
+    }
+  }
+}
+
+/* .xz compressor, uses the multithreaded encoder when more than one thread is
+   requested, thread count is lowered until the encoder fits the memory limit */
+class xz_compress_filter : public data_filter
+{
+private:
+  lzma_stream _stream;
+  u32 _preset;
+  u32 _threads;
+  u64 _blockSize;
+  u64 _memoryLimit;
+  lzma_check _check;
+  bool _initialized;
+
+public:
+  xz_compress_filter(u32 preset = LZMA_PRESET_DEFAULT, u32 threads = thread_pool::defaultConcurrency(), u64 blockSize = 0, u64 memoryLimit = UINT64_MAX, lzma_check check = LZMA_CHECK_CRC64, size_t bufferSize = KB64) :
+  data_filter(bufferSize), _stream(LZMA_STREAM_INIT), _preset(preset), _threads(threads), _blockSize(blockSize), _memoryLimit(memoryLimit), _check(check), _initialized(false) { }
+
+  ~xz_compress_filter() { finalize(); }
+
+  void init() override
+  {
+    lzma_ret r;
+    _stream = LZMA_STREAM_INIT;
+
+    if (_threads > 1)
+    {
+      lzma_mt mt;
+      memset(&mt, 0, sizeof(mt));
+      mt.flags = 0;
+      mt.block_size = _blockSize;
+      mt.timeout = 0;
+      mt.preset = _preset;
+      mt.filters = nullptr;
+      mt.check = _check;
+
+      for (mt.threads = _threads; mt.threads > 1 && lzma_stream_encoder_mt_memusage(&mt) > _memoryLimit; --mt.threads) ;
+
+      TRACE_P("%p: xz_compress_filter::init() threads: %u memusage: %lu", this, mt.threads, lzma_stream_encoder_mt_memusage(&mt));
+
+      r = lzma_stream_encoder_mt(&_stream, &mt);
+    }
+    else
+      r = lzma_easy_encoder(&_stream, _preset, _check);
+
+    if (r != LZMA_OK)
+      throw exceptions::messaged_exception(fmt::sprintf("xz_compress_filter: %s", hidden::lzmaErrorMessage(r)));
+
+    _initialized = true;
+  }
+
+  void process() override
+  {
+    const size_t availableIn = _in.used();
+    const size_t availableOut = _out.available();
+
+    _stream.next_in = _in.head();
+    _stream.avail_in = availableIn;
+    _stream.next_out = _out.tail();
+    _stream.avail_out = availableOut;
+
+    lzma_ret r = lzma_code(&_stream, ended() ? LZMA_FINISH : LZMA_RUN);
+
+    _in.consume(availableIn - _stream.avail_in);
+    _out.advance(availableOut - _stream.avail_out);
+
+    if (r == LZMA_STREAM_END)
+      markFinished();
+    else if (r != LZMA_OK && r != LZMA_BUF_ERROR)
+      throw exceptions::messaged_exception(fmt::sprintf("xz_compress_filter: %s", hidden::lzmaErrorMessage(r)));
+  }
+
+  void finalize() override
+  {
+    if (_initialized)
+    {
+      lzma_end(&_stream);
+      _initialized = false;
+    }
+  }
+
+  size_t totalIn() const { return _stream.total_in; }
+  size_t totalOut() const { return _stream.total_out; }
+
+  std::string name() override { return "xz_compress"; }
+};
+
+/* .xz decompressor, concatenated streams are decoded as a single one */
+class xz_decompress_filter : public data_filter
+{
+private:
+  lzma_stream _stream;
+  u64 _memoryLimit;
+  bool _initialized;
+
+public:
+  xz_decompress_filter(u64 memoryLimit = UINT64_MAX, size_t bufferSize = KB64) :
+  data_filter(bufferSize), _stream(LZMA_STREAM_INIT), _memoryLimit(memoryLimit), _initialized(false) { }
+
+  ~xz_decompress_filter() { finalize(); }
+
+  void init() override
+  {
+    _stream = LZMA_STREAM_INIT;
+
+    lzma_ret r = lzma_stream_decoder(&_stream, _memoryLimit, LZMA_CONCATENATED);
+
+    if (r != LZMA_OK)
+      throw exceptions::messaged_exception(fmt::sprintf("xz_decompress_filter: %s", hidden::lzmaErrorMessage(r)));
+
+    _initialized = true;
+  }
+
+  void process() override
+  {
+    const size_t availableIn = _in.used();
+    const size_t availableOut = _out.available();
+
+    _stream.next_in = _in.head();
+    _stream.avail_in = availableIn;
+    _stream.next_out = _out.tail();
+    _stream.avail_out = availableOut;
+
+    lzma_ret r = lzma_code(&_stream, ended() ? LZMA_FINISH : LZMA_RUN);
+
+    _in.consume(availableIn - _stream.avail_in);
+    _out.advance(availableOut - _stream.avail_out);
+
+    if (r == LZMA_STREAM_END)
+      markFinished();
+    /* buffer error is only fatal if no more input can arrive and there was room to progress */
+    else if (r == LZMA_BUF_ERROR && !(ended() && availableIn == 0 && availableOut > 0))
+      return;
+    else if (r != LZMA_OK)
+      throw exceptions::file_format_error(fmt::sprintf("xz_decompress_filter: %s", hidden::lzmaErrorMessage(r)));
+  }
+
+  void finalize() override
+  {
+    if (_initialized)
+    {
+      lzma_end(&_stream);
+      _initialized = false;
+    }
+  }
+
+  size_t totalIn() const { return _stream.total_in; }
+  size_t totalOut() const { return _stream.total_out; }
+
+  std::string name() override { return "xz_decompress"; }
+};
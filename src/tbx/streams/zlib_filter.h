@@ -0,0 +1,187 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "data_filter.h"
+
+#include <zlib.h>
+
+enum class zlib_format
+{
+  ZLIB,
+  GZIP,
+  RAW,
+  AUTO /* inflate only, detects zlib or gzip header */
+};
+
+namespace hidden
+{
+  inline int zlibWindowBits(zlib_format format, int windowBits)
+  {
+    switch (format)
+    {
+      case zlib_format::ZLIB: return windowBits;
+      case zlib_format::GZIP: return windowBits + 16;
+      case zlib_format::RAW: return -windowBits;
+      case zlib_format::AUTO: return windowBits + 32;
+    }
+
+    return windowBits;
+  }
+}
+
+class deflate_filter : public data_filter
+{
+private:
+  z_stream _stream;
+  zlib_format _format;
+  int _level;
+  int _windowBits;
+  bool _initialized;
+
+public:
+  deflate_filter(zlib_format format = zlib_format::ZLIB, int level = Z_DEFAULT_COMPRESSION, int windowBits = MAX_WBITS, size_t bufferSize = KB16) :
+  data_filter(bufferSize), _format(format), _level(level), _windowBits(windowBits), _initialized(false)
+  {
+    assert(format != zlib_format::AUTO);
+    assert(windowBits >= 9 && windowBits <= MAX_WBITS);
+  }
+
+  ~deflate_filter() { finalize(); }
+
+  void init() override
+  {
+    _stream.zalloc = Z_NULL;
+    _stream.zfree = Z_NULL;
+    _stream.opaque = Z_NULL;
+    _stream.avail_in = 0;
+    _stream.next_in = Z_NULL;
+
+    int r = deflateInit2(&_stream, _level, Z_DEFLATED, hidden::zlibWindowBits(_format, _windowBits), 8, Z_DEFAULT_STRATEGY);
+
+    if (r != Z_OK)
+      throw exceptions::messaged_exception(fmt::sprintf("deflate_filter: init failed (%d)", r));
+
+    _initialized = true;
+  }
+
+  void process() override
+  {
+    _stream.next_in = _in.head();
+    _stream.avail_in = static_cast<uInt>(_in.used());
+    _stream.next_out = _out.tail();
+    _stream.avail_out = static_cast<uInt>(_out.available());
+
+    int r = ::deflate(&_stream, ended() ? Z_FINISH : Z_NO_FLUSH);
+
+    if (r == Z_STREAM_ERROR)
+      throw exceptions::messaged_exception("deflate_filter: stream error");
+
+    _in.consume(_in.used() - _stream.avail_in);
+    _out.advance(_out.available() - _stream.avail_out);
+
+    TRACE_P("%p: deflate_filter::process() in: %lu out: %lu", this, _stream.total_in, _stream.total_out);
+
+    if (r == Z_STREAM_END)
+      markFinished();
+  }
+
+  void finalize() override
+  {
+    if (_initialized)
+    {
+      deflateEnd(&_stream);
+      _initialized = false;
+    }
+  }
+
+  /* adler32 for ZLIB format, crc32 for GZIP format */
+  u32 checksum() const { return static_cast<u32>(_stream.adler); }
+  size_t totalIn() const { return _stream.total_in; }
+  size_t totalOut() const { return _stream.total_out; }
+
+  std::string name() override { return "deflate"; }
+};
+
+class inflate_filter : public data_filter
+{
+private:
+  z_stream _stream;
+  zlib_format _format;
+  int _windowBits;
+  bool _initialized;
+
+public:
+  inflate_filter(zlib_format format = zlib_format::AUTO, int windowBits = MAX_WBITS, size_t bufferSize = KB16) :
+  data_filter(bufferSize), _format(format), _windowBits(windowBits), _initialized(false)
+  {
+    assert(windowBits >= 8 && windowBits <= MAX_WBITS);
+  }
+
+  ~inflate_filter() { finalize(); }
+
+  void init() override
+  {
+    _stream.zalloc = Z_NULL;
+    _stream.zfree = Z_NULL;
+    _stream.opaque = Z_NULL;
+    _stream.avail_in = 0;
+    _stream.next_in = Z_NULL;
+
+    int r = inflateInit2(&_stream, hidden::zlibWindowBits(_format, _windowBits));
+
+    if (r != Z_OK)
+      throw exceptions::messaged_exception(fmt::sprintf("inflate_filter: init failed (%d)", r));
+
+    _initialized = true;
+  }
+
+  void process() override
+  {
+    const size_t availableIn = _in.used();
+    const size_t availableOut = _out.available();
+
+    _stream.next_in = _in.head();
+    _stream.avail_in = static_cast<uInt>(availableIn);
+    _stream.next_out = _out.tail();
+    _stream.avail_out = static_cast<uInt>(availableOut);
+
+    int r = ::inflate(&_stream, Z_NO_FLUSH);
+
+    switch (r)
+    {
+      case Z_NEED_DICT:
+      case Z_DATA_ERROR:
+        throw exceptions::file_format_error(fmt::sprintf("inflate_filter: %s", _stream.msg ? _stream.msg : "invalid data"));
+      case Z_MEM_ERROR:
+        throw exceptions::not_enough_memory("inflate_filter");
+      case Z_STREAM_ERROR:
+        throw exceptions::messaged_exception("inflate_filter: stream error");
+    }
+
+    _in.consume(availableIn - _stream.avail_in);
+    _out.advance(availableOut - _stream.avail_out);
+
+    TRACE_P("%p: inflate_filter::process() in: %lu out: %lu", this, _stream.total_in, _stream.total_out);
+
+    if (r == Z_STREAM_END)
+      markFinished();
+    /* no more input will come and zlib couldn't progress with room available: stream is truncated */
+    else if (r == Z_BUF_ERROR && ended() && availableIn == 0 && availableOut > 0)
+      throw exceptions::file_format_error("inflate_filter: unexpected end of stream");
+  }
+
+  void finalize() override
+  {
+    if (_initialized)
+    {
+      inflateEnd(&_stream);
+      _initialized = false;
+    }
+  }
+
+  u32 checksum() const { return static_cast<u32>(_stream.adler); }
+  size_t totalIn() const { return _stream.total_in; }
+  size_t totalOut() const { return _stream.total_out; }
+
+  std::string name() override { return "inflate"; }
+};